@@ -53,6 +53,7 @@ int main(int argc, char **argv) {
     /*** 1. Initialize k-d tree */
     KD_TREE<PointType>::Ptr kdtree_ptr(new KD_TREE<PointType>(0.3, 0.6, 0.2));
     KD_TREE<PointType>      &ikd_Tree        = *kdtree_ptr;
+    ikd_Tree.set_removed_points_recording(true);
 
     /*** 2. Load point cloud data */
     pcl::PointCloud<PointType>::Ptr src(new pcl::PointCloud<PointType>);
@@ -0,0 +1,318 @@
+/*
+    Description: Repeatable microbenchmarks of ikd-Tree on synthetic LiDAR scans
+    Usage: ikd_tree_bench [--scans N] [--warmup N] [--repeat N] [--seed N] [--json file]
+
+    A 32-beam sensor drives along a street lined with buildings and poles, every scan is ray cast against the scene with a fixed seed.
+    Each workload is run with rebuilds done inline (sync) and on the background rebuild thread (background), the first scans of
+    every repetition are discarded as warm-up, and the median and 99th percentile of the per-call latency are reported.
+*/
+#include <ikd_Tree.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <algorithm>
+
+using PointType = ikdTree_PointType;
+using PointVector = KD_TREE<PointType>::PointVector;
+
+#define Beam_Num 32
+#define Beam_Min_Elevation -25.0
+#define Beam_Max_Elevation 15.0
+#define Azimuth_Resolution 0.4
+#define Max_Range 80.0
+#define Range_Noise 0.02
+#define Sensor_Height 1.8
+#define Scan_Step 1.0
+#define Map_Scan_Num 10
+#define Query_Num 100
+#define Delete_Lag 5
+#define Delete_Stride 10
+#define Box_Op_Num 4
+#define Box_Half_Length 1.0
+#define Search_Radius 0.5
+#define Downsample_Size 0.2
+
+struct Box_Obstacle_Type{
+    float min_value[3];
+    float max_value[3];
+};
+
+struct Pole_Obstacle_Type{
+    float x, y, radius, height;
+};
+
+struct Bench_Config_Type{
+    int scan_num = 30;
+    int warmup_num = 5;
+    int repeat_num = 3;
+    unsigned int seed = 42;
+    string json_path = "ikd_tree_bench.json";
+};
+
+struct Bench_Result_Type{
+    string name;
+    string mode;
+    vector<double> latency;
+};
+
+vector<Box_Obstacle_Type> buildings;
+vector<Pole_Obstacle_Type> poles;
+vector<Bench_Result_Type> results;
+
+/*
+   Synthetic scene: buildings on both sides of a street along x and poles along the curbs
+*/
+
+void generate_scene(int scan_num, unsigned int seed){
+    mt19937 gen(seed);
+    uniform_real_distribution<float> length(6.0, 25.0), depth(8.0, 20.0), height(4.0, 30.0), gap(1.0, 6.0), setback(8.0, 12.0);
+    float x_max = (scan_num + Map_Scan_Num) * Scan_Step + Max_Range;
+    buildings.clear();
+    poles.clear();
+    for (int side = -1; side <= 1; side += 2){
+        float x = -Max_Range;
+        while (x < x_max){
+            Box_Obstacle_Type building;
+            float y = side * setback(gen), l = length(gen), d = depth(gen);
+            building.min_value[0] = x;
+            building.max_value[0] = x + l;
+            building.min_value[1] = side > 0 ? y : y - d;
+            building.max_value[1] = side > 0 ? y + d : y;
+            building.min_value[2] = 0.0;
+            building.max_value[2] = height(gen);
+            buildings.push_back(building);
+            x += l + gap(gen);
+        }
+        for (x = -Max_Range; x < x_max; x += 10.0) poles.push_back(Pole_Obstacle_Type{x + gap(gen), side * 6.0f, 0.15f, 8.0f});
+    }
+}
+
+bool intersect_box(const float origin[3], const float dir[3], const Box_Obstacle_Type & box, float & range){
+    float t_min = 0.0, t_max = range;
+    for (int k = 0; k < 3; k++){
+        if (fabs(dir[k]) < 1e-9){
+            if (origin[k] < box.min_value[k] || origin[k] > box.max_value[k]) return false;
+            continue;
+        }
+        float t0 = (box.min_value[k] - origin[k]) / dir[k], t1 = (box.max_value[k] - origin[k]) / dir[k];
+        if (t0 > t1) swap(t0, t1);
+        t_min = max(t_min, t0);
+        t_max = min(t_max, t1);
+        if (t_min > t_max) return false;
+    }
+    range = t_min;
+    return true;
+}
+
+bool intersect_pole(const float origin[3], const float dir[3], const Pole_Obstacle_Type & pole, float & range){
+    float ox = origin[0] - pole.x, oy = origin[1] - pole.y;
+    float a = dir[0] * dir[0] + dir[1] * dir[1], b = 2 * (ox * dir[0] + oy * dir[1]), c = ox * ox + oy * oy - pole.radius * pole.radius;
+    float disc = b * b - 4 * a * c;
+    if (a < 1e-9 || disc < 0) return false;
+    float t = (-b - sqrt(disc)) / (2 * a);
+    if (t <= 0 || t >= range) return false;
+    float z = origin[2] + t * dir[2];
+    if (z < 0 || z > pole.height) return false;
+    range = t;
+    return true;
+}
+
+/*
+   Ray cast one scan from the sensor pose of scan index, points are returned in the world frame
+*/
+
+void generate_scan(int index, mt19937 & gen, PointVector & scan){
+    normal_distribution<float> noise(0.0, Range_Noise);
+    float origin[3] = {float(index * Scan_Step), 0.0f, float(Sensor_Height)};
+    vector<const Box_Obstacle_Type *> near_buildings;
+    vector<const Pole_Obstacle_Type *> near_poles;
+    for (int i = 0; i < buildings.size(); i++){
+        if (buildings[i].max_value[0] > origin[0] - Max_Range && buildings[i].min_value[0] < origin[0] + Max_Range) near_buildings.push_back(&buildings[i]);
+    }
+    for (int i = 0; i < poles.size(); i++){
+        if (fabs(poles[i].x - origin[0]) < Max_Range) near_poles.push_back(&poles[i]);
+    }
+    scan.clear();
+    for (int beam = 0; beam < Beam_Num; beam++){
+        double elevation = (Beam_Min_Elevation + (Beam_Max_Elevation - Beam_Min_Elevation) * beam / (Beam_Num - 1)) * M_PI / 180.0;
+        for (double azimuth = 0.0; azimuth < 360.0; azimuth += Azimuth_Resolution){
+            float dir[3] = {float(cos(elevation) * cos(azimuth * M_PI / 180.0)), float(cos(elevation) * sin(azimuth * M_PI / 180.0)), float(sin(elevation))};
+            float range = Max_Range;
+            bool hit = false;
+            if (dir[2] < 0 && -origin[2] / dir[2] < range){
+                range = -origin[2] / dir[2];
+                hit = true;
+            }
+            for (int i = 0; i < near_buildings.size(); i++) hit |= intersect_box(origin, dir, *near_buildings[i], range);
+            for (int i = 0; i < near_poles.size(); i++) hit |= intersect_pole(origin, dir, *near_poles[i], range);
+            if (!hit) continue;
+            range += noise(gen);
+            scan.push_back(PointType(origin[0] + range * dir[0], origin[1] + range * dir[1], origin[2] + range * dir[2]));
+        }
+    }
+}
+
+/*
+   Timing and reporting
+*/
+
+template <typename Func>
+double time_call(Func func){
+    auto start = chrono::high_resolution_clock::now();
+    func();
+    auto end = chrono::high_resolution_clock::now();
+    return chrono::duration<double, std::micro>(end - start).count();
+}
+
+Bench_Result_Type & bench_result(const string & name, const string & mode){
+    for (int i = 0; i < results.size(); i++){
+        if (results[i].name == name && results[i].mode == mode) return results[i];
+    }
+    results.push_back(Bench_Result_Type{name, mode, vector<double>()});
+    return results.back();
+}
+
+double percentile(const vector<double> & latency, double ratio){
+    return latency[min(int(latency.size() * ratio), int(latency.size()) - 1)];
+}
+
+/*
+   One repetition of the mapping workload: build from the first scans, then per scan insert, delete old points,
+   delete and restore boxes, and query with points of the next scan
+*/
+
+void run_workload(const vector<PointVector> & scans, const Bench_Config_Type & config, const string & mode, bool downsample){
+    RebuildPolicyType rebuild_policy;
+    rebuild_policy.mode = mode == "sync" ? SYNC_REBUILD : MULTI_THREAD_REBUILD;
+    KD_TREE<PointType>::Ptr kdtree_ptr(new KD_TREE<PointType>(0.5, 0.6, Downsample_Size, rebuild_policy));
+    KD_TREE<PointType> & ikd_Tree = *kdtree_ptr;
+    mt19937 gen(config.seed + 1);
+    uniform_real_distribution<float> jitter(-0.5, 0.5);
+    PointVector map_points;
+    for (int i = 0; i < Map_Scan_Num; i++) map_points.insert(map_points.end(), scans[i].begin(), scans[i].end());
+    ikd_Tree.Build(map_points);
+    const int k_list[4] = {1, 5, 10, 20};
+    for (int s = Map_Scan_Num; s + 1 < scans.size(); s++){
+        bool record = s >= Map_Scan_Num + config.warmup_num;
+        PointVector scan = scans[s];
+        double latency = time_call([&]{ ikd_Tree.Add_Points(scan, downsample); });
+        if (downsample){
+            if (record) bench_result("add_points_downsample", mode).latency.push_back(latency);
+            continue;
+        }
+        if (record) bench_result("add_points", mode).latency.push_back(latency);
+        PointVector old_points;
+        for (int i = 0; i < scans[s - Delete_Lag].size(); i += Delete_Stride) old_points.push_back(scans[s - Delete_Lag][i]);
+        latency = time_call([&]{ ikd_Tree.Delete_Points(old_points); });
+        if (record) bench_result("delete_points", mode).latency.push_back(latency);
+        for (int i = 0; i < Box_Op_Num; i++){
+            const PointType & center = scans[s - 1][gen() % scans[s - 1].size()];
+            vector<BoxPointType> boxes(1);
+            boxes[0].vertex_min[0] = center.x - Box_Half_Length; boxes[0].vertex_max[0] = center.x + Box_Half_Length;
+            boxes[0].vertex_min[1] = center.y - Box_Half_Length; boxes[0].vertex_max[1] = center.y + Box_Half_Length;
+            boxes[0].vertex_min[2] = center.z - Box_Half_Length; boxes[0].vertex_max[2] = center.z + Box_Half_Length;
+            latency = time_call([&]{ ikd_Tree.Delete_Point_Boxes(boxes); });
+            if (record) bench_result("delete_point_boxes", mode).latency.push_back(latency);
+            latency = time_call([&]{ ikd_Tree.Add_Point_Boxes(boxes); });
+            if (record) bench_result("add_point_boxes", mode).latency.push_back(latency);
+        }
+        for (int q = 0; q < Query_Num; q++){
+            PointType query = scans[s + 1][gen() % scans[s + 1].size()];
+            query.x += jitter(gen);
+            query.y += jitter(gen);
+            query.z += jitter(gen);
+            PointVector search_result;
+            vector<float> point_distance;
+            for (int i = 0; i < 4; i++){
+                latency = time_call([&]{ ikd_Tree.Nearest_Search(query, k_list[i], search_result, point_distance); });
+                if (record) bench_result("knn_k" + to_string(k_list[i]), mode).latency.push_back(latency);
+            }
+            BoxPointType box;
+            box.vertex_min[0] = query.x - Box_Half_Length; box.vertex_max[0] = query.x + Box_Half_Length;
+            box.vertex_min[1] = query.y - Box_Half_Length; box.vertex_max[1] = query.y + Box_Half_Length;
+            box.vertex_min[2] = query.z - Box_Half_Length; box.vertex_max[2] = query.z + Box_Half_Length;
+            latency = time_call([&]{ ikd_Tree.Box_Search(box, search_result); });
+            if (record) bench_result("box_search", mode).latency.push_back(latency);
+            latency = time_call([&]{ ikd_Tree.Radius_Search(query, Search_Radius, search_result); });
+            if (record) bench_result("radius_search", mode).latency.push_back(latency);
+        }
+    }
+}
+
+void run_build(const vector<PointVector> & scans, const string & mode){
+    RebuildPolicyType rebuild_policy;
+    rebuild_policy.mode = mode == "sync" ? SYNC_REBUILD : MULTI_THREAD_REBUILD;
+    PointVector map_points;
+    for (int i = 0; i < Map_Scan_Num; i++) map_points.insert(map_points.end(), scans[i].begin(), scans[i].end());
+    KD_TREE<PointType>::Ptr kdtree_ptr(new KD_TREE<PointType>(0.5, 0.6, Downsample_Size, rebuild_policy));
+    double latency = time_call([&]{ kdtree_ptr->Build(map_points); });
+    bench_result("build", mode).latency.push_back(latency);
+}
+
+bool write_json(const Bench_Config_Type & config, int point_num){
+    FILE * fp = fopen(config.json_path.c_str(), "w");
+    if (fp == nullptr) return false;
+    fprintf(fp, "{\n  \"config\": {\"scans\": %d, \"warmup\": %d, \"repeat\": %d, \"seed\": %u, \"map_points\": %d},\n  \"results\": [\n",
+            config.scan_num, config.warmup_num, config.repeat_num, config.seed, point_num);
+    for (int i = 0; i < results.size(); i++){
+        const vector<double> & latency = results[i].latency;
+        fprintf(fp, "    {\"name\": \"%s\", \"mode\": \"%s\", \"samples\": %d, \"median_us\": %.3f, \"p99_us\": %.3f, \"min_us\": %.3f, \"max_us\": %.3f}%s\n",
+                results[i].name.c_str(), results[i].mode.c_str(), int(latency.size()), percentile(latency, 0.5), percentile(latency, 0.99),
+                latency.front(), latency.back(), i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Bench_Config_Type config;
+    for (int i = 1; i + 1 < argc; i += 2){
+        if (strcmp(argv[i], "--scans") == 0) config.scan_num = max(atoi(argv[i+1]), 1);
+        else if (strcmp(argv[i], "--warmup") == 0) config.warmup_num = max(atoi(argv[i+1]), 0);
+        else if (strcmp(argv[i], "--repeat") == 0) config.repeat_num = max(atoi(argv[i+1]), 1);
+        else if (strcmp(argv[i], "--seed") == 0) config.seed = strtoul(argv[i+1], nullptr, 10);
+        else if (strcmp(argv[i], "--json") == 0) config.json_path = argv[i+1];
+        else {
+            printf("Usage: %s [--scans N] [--warmup N] [--repeat N] [--seed N] [--json file]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    /*** 1. Generate the scene and the scans once, every repetition replays the same scans */
+    generate_scene(config.scan_num + config.warmup_num, config.seed);
+    mt19937 gen(config.seed);
+    vector<PointVector> scans(Map_Scan_Num + config.warmup_num + config.scan_num + 1);
+    for (int i = 0; i < scans.size(); i++) generate_scan(i, gen, scans[i]);
+    int point_num = 0;
+    for (int i = 0; i < Map_Scan_Num; i++) point_num += scans[i].size();
+    printf("%d scans of about %d points, %d points in the initial map\n", int(scans.size()), int(scans[0].size()), point_num);
+
+    /*** 2. Run every workload with inline and background rebuilds, discarding one untimed warm-up repetition */
+    const string modes[2] = {"sync", "background"};
+    for (int m = 0; m < 2; m++){
+        for (int r = 0; r <= config.repeat_num; r++){
+            vector<Bench_Result_Type> kept_results = results;
+            run_build(scans, modes[m]);
+            run_workload(scans, config, modes[m], false);
+            run_workload(scans, config, modes[m], true);
+            if (r == 0) results.swap(kept_results);
+        }
+    }
+
+    /*** 3. Report */
+    printf("%-24s %-11s %8s %12s %12s %12s\n", "benchmark", "mode", "samples", "median (us)", "p99 (us)", "max (us)");
+    for (int i = 0; i < results.size(); i++){
+        vector<double> & latency = results[i].latency;
+        sort(latency.begin(), latency.end());
+        printf("%-24s %-11s %8d %12.3f %12.3f %12.3f\n", results[i].name.c_str(), results[i].mode.c_str(), int(latency.size()),
+               percentile(latency, 0.5), percentile(latency, 0.99), latency.back());
+    }
+    if (!write_json(config, point_num)){
+        printf("Failed to write %s\n", config.json_path.c_str());
+        return -1;
+    }
+    printf("Results written to %s\n", config.json_path.c_str());
+    return 0;
+}
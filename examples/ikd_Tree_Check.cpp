@@ -0,0 +1,536 @@
+/*
+    Description: Self-checks of the map maintenance features against a brute force model of the map, registered with ctest
+    Usage: ikd_tree_check [scratch directory]
+
+    Every check drives a tree with random scans under SYNC_REBUILD, so that the result does not depend on thread timing,
+    and compares the points left in the tree and the k nearest neighbors it returns with brute force over the same points.
+*/
+#include "ikd_Tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <random>
+#include <algorithm>
+#include "pcl/point_types.h"
+
+using PointType = pcl::PointXYZI;
+using PointVector = KD_TREE<PointType>::PointVector;
+
+#define Map_Size 40.0f
+#define Scan_Num 60
+#define Scan_Point_Num 500
+#define Scan_Radius 4.0f
+#define Capacity 12000
+#define Query_Num 50
+#define K_NEAREST 5
+#define Max_Checkpoint_Generation 64
+#define Tile_Size 10.0f
+#define Max_Resident_Tiles 4
+#define Tile_Query_Range 3.0f
+#define Tile_Query_Dist 2.0
+
+bool point_less(const PointType & a, const PointType & b){
+    if (a.x != b.x) return a.x < b.x;
+    if (a.y != b.y) return a.y < b.y;
+    if (a.z != b.z) return a.z < b.z;
+    return a.intensity < b.intensity;
+}
+
+bool point_equal(const PointType & a, const PointType & b){
+    return a.x == b.x && a.y == b.y && a.z == b.z && a.intensity == b.intensity;
+}
+
+KD_TREE<PointType> * new_tree(){
+    RebuildPolicyType rebuild_policy;
+    rebuild_policy.mode = SYNC_REBUILD;
+    KD_TREE<PointType> * tree = new KD_TREE<PointType>(0.5, 0.6, 0.2, rebuild_policy);
+    /*** The scan index is kept in the intensity channel as the point timestamp */
+    tree->set_point_timestamp([](const PointType & point){ return double(point.intensity); });
+    return tree;
+}
+
+/*** The valid points of the tree in point_less order */
+PointVector tree_points(KD_TREE<PointType> & tree){
+    PointVector points;
+    tree.flush_insert_buffer();
+    if (tree.Root_Node != nullptr) tree.flatten(tree.Root_Node, points, NOT_RECORD);
+    sort(points.begin(), points.end(), point_less);
+    return points;
+}
+
+BoxPointType box_around(const PointType & center, float half_length){
+    BoxPointType box;
+    box.vertex_min[0] = center.x - half_length;
+    box.vertex_min[1] = center.y - half_length;
+    box.vertex_min[2] = center.z - half_length;
+    for (int k = 0; k < 3; k++) box.vertex_max[k] = box.vertex_min[k] + 2 * half_length;
+    return box;
+}
+
+bool inside_box(const PointType & point, const BoxPointType & box){
+    return point.x >= box.vertex_min[0] && point.x <= box.vertex_max[0] && point.y >= box.vertex_min[1] && point.y <= box.vertex_max[1]
+        && point.z >= box.vertex_min[2] && point.z <= box.vertex_max[2];
+}
+
+bool same_points(const PointVector & a, const PointVector & b){
+    return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), point_equal);
+}
+
+/*** Copies the leading keep_ratio of a file, as left behind by an interrupted write */
+bool truncated_copy(const string & src_path, const string & dst_path, double keep_ratio){
+    FILE * src = fopen(src_path.c_str(), "rb");
+    if (src == nullptr) return false;
+    vector<char> data;
+    char buffer[4096];
+    size_t read_size;
+    while ((read_size = fread(buffer, 1, sizeof(buffer), src)) > 0) data.insert(data.end(), buffer, buffer + read_size);
+    fclose(src);
+    FILE * dst = fopen(dst_path.c_str(), "wb");
+    if (dst == nullptr) return false;
+    size_t keep_size = size_t(data.size() * keep_ratio);
+    bool success = fwrite(data.data(), 1, keep_size, dst) == keep_size;
+    return fclose(dst) == 0 && success;
+}
+
+/*** Copies a file with the 4 bytes at offset overwritten, as a corrupt node record */
+bool corrupted_copy(const string & src_path, const string & dst_path, size_t offset, int32_t value){
+    if (!truncated_copy(src_path, dst_path, 1.0)) return false;
+    FILE * dst = fopen(dst_path.c_str(), "r+b");
+    if (dst == nullptr) return false;
+    bool success = fseek(dst, offset, SEEK_SET) == 0 && fwrite(&value, sizeof(value), 1, dst) == 1;
+    return fclose(dst) == 0 && success;
+}
+
+PointVector random_scan(std::mt19937 & gen, float time){
+    std::uniform_real_distribution<float> position(0.0f, Map_Size), offset(-Scan_Radius, Scan_Radius);
+    float center[3] = {position(gen), position(gen), position(gen)};
+    PointVector scan(Scan_Point_Num);
+    for (int i = 0; i < Scan_Point_Num; i++){
+        scan[i].x = center[0] + offset(gen);
+        scan[i].y = center[1] + offset(gen);
+        scan[i].z = center[2] + offset(gen);
+        scan[i].intensity = time;
+    }
+    return scan;
+}
+
+/*** Compares the k nearest neighbor distances of random queries with brute force over the given points, returns the number of mismatches */
+template <typename TreeType>
+int check_nearest_search(TreeType & tree, const PointVector & points, std::mt19937 & gen){
+    std::uniform_real_distribution<float> position(0.0f, Map_Size);
+    PointVector search_result;
+    vector<float> tree_dist, brute_dist(points.size());
+    int mismatch = 0;
+    for (int i = 0; i < Query_Num; i++){
+        PointType query;
+        query.x = position(gen);
+        query.y = position(gen);
+        query.z = position(gen);
+        tree.Nearest_Search(query, K_NEAREST, search_result, tree_dist);
+        for (int j = 0; j < points.size(); j++){
+            float dx = points[j].x - query.x, dy = points[j].y - query.y, dz = points[j].z - query.z;
+            brute_dist[j] = dx * dx + dy * dy + dz * dz;
+        }
+        int k_found = min(K_NEAREST, int(points.size()));
+        partial_sort(brute_dist.begin(), brute_dist.begin() + k_found, brute_dist.end());
+        if (tree_dist.size() != k_found){
+            mismatch ++;
+            continue;
+        }
+        for (int j = 0; j < k_found; j++){
+            if (fabs(tree_dist[j] - brute_dist[j]) > 1e-4f){
+                mismatch ++;
+                break;
+            }
+        }
+    }
+    return mismatch;
+}
+
+/*** Bounded map: the tree stays under its capacity, only removes points its policy ranks last and still answers kNN exactly */
+int check_eviction(eviction_policy_set policy){
+    std::mt19937 gen(policy);
+    KD_TREE<PointType>::Ptr kdtree_ptr(new_tree());
+    KD_TREE<PointType> & ikd_Tree = *kdtree_ptr;
+    PointType center;
+    center.x = center.y = center.z = Map_Size / 2;
+    ikd_Tree.set_capacity(Capacity, policy);
+    ikd_Tree.set_eviction_center(center);
+    ikd_Tree.Build(random_scan(gen, 0));
+    PointVector model = tree_points(ikd_Tree), candidates, removed;
+    int fails = 0, evictions = 0;
+    for (int scan = 1; scan <= Scan_Num; scan++){
+        /*** Box deletions leave lazy tags in the tree that eviction has to see through */
+        if (scan % 5 == 0){
+            vector<BoxPointType> boxes(1, box_around(model[gen() % model.size()], Scan_Radius));
+            ikd_Tree.Delete_Point_Boxes(boxes);
+            PointVector kept;
+            for (int i = 0; i < model.size(); i++){
+                if (!inside_box(model[i], boxes[0])) kept.push_back(model[i]);
+            }
+            model.swap(kept);
+        }
+        PointVector points = random_scan(gen, scan);
+        ikd_Tree.Add_Points(points, false);
+        candidates = model;
+        candidates.insert(candidates.end(), points.begin(), points.end());
+        sort(candidates.begin(), candidates.end(), point_less);
+        PointVector current = tree_points(ikd_Tree);
+        if (ikd_Tree.validnum() != current.size() || current.size() > Capacity) fails ++;
+        if (!includes(candidates.begin(), candidates.end(), current.begin(), current.end(), point_less)) fails ++;
+        removed.clear();
+        set_difference(candidates.begin(), candidates.end(), current.begin(), current.end(), back_inserter(removed), point_less);
+        if (!removed.empty()){
+            evictions ++;
+            if (current.size() < Capacity * (1.0 - 2 * EvictionSlackPercentage)) fails ++;
+        }
+        /*** Every removed point ranks behind every kept one */
+        if (!removed.empty() && policy == EVICT_FARTHEST){
+            float kept_max = 0.0f, removed_min = INFINITY;
+            for (int i = 0; i < current.size(); i++) kept_max = max(kept_max, max(fabs(current[i].x - center.x), max(fabs(current[i].y - center.y), fabs(current[i].z - center.z))));
+            for (int i = 0; i < removed.size(); i++) removed_min = min(removed_min, max(fabs(removed[i].x - center.x), max(fabs(removed[i].y - center.y), fabs(removed[i].z - center.z))));
+            if (removed_min < kept_max) fails ++;
+        }
+        if (!removed.empty() && policy == EVICT_OLDEST){
+            float kept_min = INFINITY, removed_max = -INFINITY;
+            for (int i = 0; i < current.size(); i++) kept_min = min(kept_min, current[i].intensity);
+            for (int i = 0; i < removed.size(); i++) removed_max = max(removed_max, removed[i].intensity);
+            if (removed_max >= kept_min) fails ++;
+        }
+        fails += check_nearest_search(ikd_Tree, current, gen);
+        model.swap(current);
+    }
+    if (evictions == 0) fails ++;
+    return fails;
+}
+
+/*** Save and load: the loaded tree holds the same points, a truncated file is refused and leaves the current tree as it was */
+int check_save_load(const string & scratch_directory){
+    std::mt19937 gen(7);
+    string path = scratch_directory + "/ikd_tree_check.ikd", truncated_path = scratch_directory + "/ikd_tree_check_truncated.ikd";
+    KD_TREE<PointType>::Ptr kdtree_ptr(new_tree());
+    KD_TREE<PointType> & ikd_Tree = *kdtree_ptr;
+    ikd_Tree.set_insert_buffer(64);
+    ikd_Tree.Build(random_scan(gen, 0));
+    for (int scan = 1; scan <= 20; scan++){
+        PointVector points = random_scan(gen, scan);
+        ikd_Tree.Add_Points(points, false);
+        vector<BoxPointType> boxes(1, box_around(points[0], Scan_Radius / 2));
+        if (scan % 3 == 0) ikd_Tree.Delete_Point_Boxes(boxes);
+    }
+    /*** Keep some points in the insertion buffer while saving */
+    PointVector points = random_scan(gen, 21);
+    points.resize(32);
+    ikd_Tree.Add_Points(points, false);
+    int fails = 0;
+    if (!ikd_Tree.save(path)) return 1;
+    PointVector expected = tree_points(ikd_Tree);
+
+    KD_TREE<PointType>::Ptr loaded_ptr(new_tree());
+    if (!loaded_ptr->load(path)) fails ++;
+    if (!same_points(tree_points(*loaded_ptr), expected)) fails ++;
+    fails += check_nearest_search(*loaded_ptr, expected, gen);
+
+    KD_TREE<PointType>::Ptr current_ptr(new_tree());
+    current_ptr->Build(random_scan(gen, 0));
+    PointVector current = tree_points(*current_ptr);
+    if (!truncated_copy(path, truncated_path, 0.5) || current_ptr->load(truncated_path)) fails ++;
+    if (current_ptr->load(scratch_directory + "/ikd_tree_check_missing.ikd")) fails ++;
+    if (!same_points(tree_points(*current_ptr), current)) fails ++;
+    fails += check_nearest_search(*current_ptr, current, gen);
+    remove(path.c_str());
+    remove(truncated_path.c_str());
+    return fails;
+}
+
+/*** Static tree: the mapped file answers kNN like the tree it was saved from, truncated or corrupt node records are refused at open */
+int check_static(const string & scratch_directory){
+    std::mt19937 gen(9);
+    string path = scratch_directory + "/ikd_tree_check.ikds", corrupt_path = scratch_directory + "/ikd_tree_check_corrupt.ikds";
+    KD_TREE<PointType>::Ptr kdtree_ptr(new_tree());
+    KD_TREE<PointType> & ikd_Tree = *kdtree_ptr;
+    ikd_Tree.Build(random_scan(gen, 0));
+    for (int scan = 1; scan <= 20; scan++){
+        PointVector points = random_scan(gen, scan);
+        ikd_Tree.Add_Points(points, false);
+        vector<BoxPointType> boxes(1, box_around(points[0], Scan_Radius / 2));
+        if (scan % 3 == 0) ikd_Tree.Delete_Point_Boxes(boxes);
+    }
+    if (!ikd_Tree.save_static(path)) return 1;
+    PointVector expected = tree_points(ikd_Tree);
+    int fails = 0;
+    STATIC_KD_TREE<PointType> static_tree;
+    if (!static_tree.open(path) || static_tree.size() != expected.size()) fails ++;
+    fails += check_nearest_search(static_tree, expected, gen);
+
+    if (!truncated_copy(path, corrupt_path, 0.5) || static_tree.open(corrupt_path)) fails ++;
+    if (static_tree.size() != 0) fails ++;
+    /*** A root whose left subtree covers the whole tree, then a son whose subtree runs past its father's */
+    size_t node_offset = sizeof(Static_Tree_Header_Type), node_size = sizeof(STATIC_KD_TREE<PointType>::Node_Type);
+    size_t left_size_offset = offsetof(STATIC_KD_TREE<PointType>::Node_Type, left_size), tree_size_offset = offsetof(STATIC_KD_TREE<PointType>::Node_Type, tree_size);
+    if (!corrupted_copy(path, corrupt_path, node_offset + left_size_offset, int32_t(expected.size())) || static_tree.open(corrupt_path)) fails ++;
+    if (!corrupted_copy(path, corrupt_path, node_offset + node_size + tree_size_offset, int32_t(expected.size()) - 1) || static_tree.open(corrupt_path)) fails ++;
+    remove(path.c_str());
+    remove(corrupt_path.c_str());
+    return fails;
+}
+
+void remove_tile_files(const string & directory){
+    DIR * dir = opendir(directory.c_str());
+    if (dir == nullptr) return;
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != nullptr){
+        if (strncmp(entry->d_name, "tile_", 5) == 0) remove((directory + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+}
+
+/*** Compares the nearest neighbors of queries around a tile corner with a single tree over the same points, returns the number of mismatches */
+int check_tiled_search(TILED_KD_TREE<PointType> & tiled_tree, KD_TREE<PointType> & ikd_Tree, std::mt19937 & gen){
+    std::uniform_real_distribution<float> position(Tile_Size - Tile_Query_Range, Tile_Size + Tile_Query_Range), height(0.0f, Map_Size);
+    PointVector tiled_result, tree_result;
+    vector<float> tiled_dist, tree_dist;
+    int mismatch = 0;
+    for (int i = 0; i < Query_Num; i++){
+        PointType query;
+        query.x = position(gen);
+        query.y = position(gen);
+        query.z = height(gen);
+        tiled_tree.Nearest_Search(query, K_NEAREST, tiled_result, tiled_dist, Tile_Query_Dist);
+        ikd_Tree.Nearest_Search(query, K_NEAREST, tree_result, tree_dist, Tile_Query_Dist);
+        if (tiled_dist != tree_dist) mismatch ++;
+    }
+    return mismatch;
+}
+
+/*** Tiled map: no more than max_resident_tiles stay in memory, with or without a pose, and tiles paged out and back in answer kNN across tile boundaries like one tree */
+int check_tiles(const string & scratch_directory){
+    std::mt19937 gen(19);
+    string directory = scratch_directory + "/ikd_tree_check_tiles";
+    mkdir(directory.c_str(), 0755);
+    remove_tile_files(directory);
+    RebuildPolicyType rebuild_policy;
+    rebuild_policy.mode = SYNC_REBUILD;
+    unique_ptr<TILED_KD_TREE<PointType>> tiled_ptr(new TILED_KD_TREE<PointType>(directory, Tile_Size, Tile_Size / 2, 0.5, 0.6, 0.2, rebuild_policy));
+    TILED_KD_TREE<PointType> & tiled_tree = *tiled_ptr;
+    tiled_tree.set_max_resident_tiles(Max_Resident_Tiles);
+    KD_TREE<PointType>::Ptr kdtree_ptr(new_tree());
+    KD_TREE<PointType> & ikd_Tree = *kdtree_ptr;
+    int fails = 0;
+    /*** Writes before the first pose keep the most recently written tiles */
+    for (int scan = 0; scan < Scan_Num; scan++){
+        PointVector points = random_scan(gen, scan);
+        if (scan == 0) ikd_Tree.Build(points);
+            else ikd_Tree.Add_Points(points, false);
+        tiled_tree.Add_Points(points, false);
+        tiled_tree.wait_for_paging();
+        if (tiled_tree.resident_tile_num() > Max_Resident_Tiles) fails ++;
+    }
+    /*** The scans must span more tiles than stay resident for the paging to be checked */
+    if (tiled_tree.tile_num() <= Max_Resident_Tiles) fails ++;
+
+    PointType pose;
+    pose.x = Tile_Size;
+    pose.y = Tile_Size;
+    pose.z = 0.0f;
+    tiled_tree.update_pose(pose);
+    tiled_tree.wait_for_paging();
+    fails += check_tiled_search(tiled_tree, ikd_Tree, gen);
+    /*** Travel away so that the tiles around the corner are paged out, then come back */
+    PointType far_pose = pose;
+    far_pose.x = far_pose.y = Map_Size;
+    tiled_tree.update_pose(far_pose);
+    tiled_tree.wait_for_paging();
+    if (tiled_tree.resident_tile_num() > Max_Resident_Tiles) fails ++;
+    tiled_tree.update_pose(pose);
+    tiled_tree.wait_for_paging();
+    if (tiled_tree.resident_tile_num() > Max_Resident_Tiles) fails ++;
+    fails += check_tiled_search(tiled_tree, ikd_Tree, gen);
+    tiled_ptr.reset();
+    remove_tile_files(directory);
+    rmdir(directory.c_str());
+    return fails;
+}
+
+void remove_journal_files(const string & path){
+    remove((path + ".journal").c_str());
+    for (int generation = 0; generation < Max_Checkpoint_Generation; generation++) remove((path + ".checkpoint." + to_string(generation)).c_str());
+}
+
+/*** Journal recovery: a tree reopened from the journal of a tree that was never closed holds the same points, also after a torn record */
+int check_journal(const string & scratch_directory){
+    std::mt19937 gen(11);
+    string path = scratch_directory + "/ikd_tree_check_map";
+    remove_journal_files(path);
+    KD_TREE<PointType>::Ptr kdtree_ptr(new_tree());
+    KD_TREE<PointType> & ikd_Tree = *kdtree_ptr;
+    ikd_Tree.set_capacity(Capacity, EVICT_FARTHEST);
+    if (!ikd_Tree.open_journal(path, false, 4096, 200000)) return 1;
+    ikd_Tree.Build(random_scan(gen, 0));
+    for (int scan = 1; scan <= 40; scan++){
+        PointVector points = random_scan(gen, scan);
+        ikd_Tree.Add_Points(points, scan % 2 == 0);
+        PointVector deleted(points.begin(), points.begin() + 50);
+        if (scan % 3 == 0) ikd_Tree.Delete_Points(deleted);
+        vector<BoxPointType> boxes(1, box_around(points[0], Scan_Radius / 2));
+        if (scan % 4 == 0) ikd_Tree.Delete_Point_Boxes(boxes);
+        if (scan == 20) ikd_Tree.checkpoint();
+        if (scan == 25) ikd_Tree.Delete_Older_Than(5);
+    }
+    int fails = 0;
+    if (!ikd_Tree.flush_journal()) fails ++;
+    PointVector expected = tree_points(ikd_Tree);
+
+    /*** Recover while the journaling tree is still alive, as after a crash */
+    KD_TREE<PointType>::Ptr recovered_ptr(new_tree());
+    recovered_ptr->set_capacity(Capacity, EVICT_FARTHEST);
+    if (!recovered_ptr->open_journal(path)) fails ++;
+    if (!same_points(tree_points(*recovered_ptr), expected)) fails ++;
+    fails += check_nearest_search(*recovered_ptr, expected, gen);
+    recovered_ptr->close_journal();
+
+    /*** A record torn by the crash is dropped */
+    FILE * fp = fopen((path + ".journal").c_str(), "ab");
+    char torn_record[37] = {1, 0, 0, 0, 100};
+    if (fp == nullptr || fwrite(torn_record, 1, sizeof(torn_record), fp) != sizeof(torn_record)) fails ++;
+    if (fp != nullptr) fclose(fp);
+    KD_TREE<PointType>::Ptr torn_ptr(new_tree());
+    torn_ptr->set_capacity(Capacity, EVICT_FARTHEST);
+    if (!torn_ptr->open_journal(path)) fails ++;
+    if (!same_points(tree_points(*torn_ptr), expected)) fails ++;
+    torn_ptr->close_journal();
+    ikd_Tree.close_journal();
+    remove_journal_files(path);
+    return fails;
+}
+
+/*** Trace replay: a tree configured from the trace header ends up with the points of the traced tree */
+int check_trace(const string & scratch_directory){
+    std::mt19937 gen(13);
+    string path = scratch_directory + "/ikd_tree_check.ikdr", truncated_path = scratch_directory + "/ikd_tree_check_truncated.ikdr";
+    KD_TREE<PointType>::Ptr kdtree_ptr(new_tree());
+    KD_TREE<PointType> & ikd_Tree = *kdtree_ptr;
+    ikd_Tree.Set_delete_criterion_param(0.4);
+    ikd_Tree.set_split_strategy(SPLIT_SLIDING_MIDPOINT);
+    ikd_Tree.set_capacity(Capacity, EVICT_OLDEST);
+    if (!ikd_Tree.start_trace(path)) return 1;
+    ikd_Tree.Build(random_scan(gen, 0));
+    PointVector search_result;
+    vector<float> search_dist;
+    for (int scan = 1; scan <= 40; scan++){
+        PointVector points = random_scan(gen, scan);
+        ikd_Tree.Add_Points(points, scan % 2 == 0, scan % 3 == 0 ? 0.01 : -1.0);
+        if (scan % 3 == 0) ikd_Tree.run_pending_rebuilds(0.05);
+        if (scan == 10) ikd_Tree.set_insert_buffer(64);
+        if (scan == 20){
+            ikd_Tree.flush_insert_buffer();
+            ikd_Tree.set_capacity(Capacity / 2, EVICT_FARTHEST);
+        }
+        if (scan % 10 == 5) ikd_Tree.Delete_Outside_Box(box_around(points[0], Map_Size / 2));
+        if (scan == 30) ikd_Tree.Delete_Older_Than(15);
+        ikd_Tree.Nearest_Search(points[0], K_NEAREST, search_result, search_dist);
+    }
+    ikd_Tree.stop_trace();
+    PointVector expected = tree_points(ikd_Tree);
+
+    int fails = 0;
+    KD_TREE<PointType>::Trace_File_Header_Type header;
+    FILE * fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr || fread(&header, sizeof(header), 1, fp) != 1) fails ++;
+    if (fp != nullptr) fclose(fp);
+    RebuildPolicyType rebuild_policy;
+    rebuild_policy.mode = rebuild_mode_set(header.config.rebuild_mode);
+    KD_TREE<PointType>::Ptr replay_ptr(new KD_TREE<PointType>(header.config.delete_param, header.config.balance_param, header.config.downsample_size, rebuild_policy));
+    replay_ptr->set_point_timestamp([](const PointType & point){ return double(point.intensity); });
+    if (!replay_ptr->replay_trace(path)) fails ++;
+    if (!same_points(tree_points(*replay_ptr), expected)) fails ++;
+
+    KD_TREE<PointType>::Ptr truncated_ptr(new_tree());
+    if (!truncated_copy(path, truncated_path, 0.5) || truncated_ptr->replay_trace(truncated_path)) fails ++;
+    remove(path.c_str());
+    remove(truncated_path.c_str());
+    return fails;
+}
+
+/*** Writes the points as a binary PCD file of x y z intensity, followed by nan_num points without coordinates */
+bool write_pcd(const string & path, const PointVector & points, int nan_num){
+    FILE * fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) return false;
+    int point_num = points.size() + nan_num;
+    fprintf(fp, "VERSION 0.7\nFIELDS x y z intensity\nSIZE 4 4 4 4\nTYPE F F F F\nCOUNT 1 1 1 1\nWIDTH %d\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS %d\nDATA binary\n", point_num, point_num);
+    bool success = true;
+    for (int i = 0; i < point_num; i++){
+        float record[4] = {NAN, NAN, NAN, 0.0f};
+        if (i < points.size()){
+            record[0] = points[i].x;
+            record[1] = points[i].y;
+            record[2] = points[i].z;
+            record[3] = points[i].intensity;
+        }
+        success = success && fwrite(record, sizeof(float), 4, fp) == 4;
+    }
+    return fclose(fp) == 0 && success;
+}
+
+/*** Point file: a tree built from a PCD file holds its finite points, a file without any leaves an empty tree that can be built again */
+int check_point_file(const string & scratch_directory){
+    std::mt19937 gen(17);
+    string path = scratch_directory + "/ikd_tree_check.pcd";
+    PointVector points;
+    for (int scan = 0; scan < 10; scan++){
+        PointVector scan_points = random_scan(gen, scan);
+        points.insert(points.end(), scan_points.begin(), scan_points.end());
+    }
+    int fails = 0;
+    KD_TREE<PointType>::Ptr kdtree_ptr(new_tree());
+    KD_TREE<PointType> & ikd_Tree = *kdtree_ptr;
+    ikd_Tree.Build(random_scan(gen, 0));
+    if (!write_pcd(path, points, 3) || !ikd_Tree.build_from_file(path)) return 1;
+    PointVector expected = points;
+    sort(expected.begin(), expected.end(), point_less);
+    if (!same_points(tree_points(ikd_Tree), expected)) fails ++;
+    fails += check_nearest_search(ikd_Tree, expected, gen);
+
+    if (!write_pcd(path, PointVector(), 3) || !ikd_Tree.build_from_file(path)) fails ++;
+    if (ikd_Tree.size() != 0) fails ++;
+    fails += check_nearest_search(ikd_Tree, PointVector(), gen);
+    expected = random_scan(gen, 10);
+    ikd_Tree.Build(expected);
+    sort(expected.begin(), expected.end(), point_less);
+    if (!same_points(tree_points(ikd_Tree), expected)) fails ++;
+    fails += check_nearest_search(ikd_Tree, expected, gen);
+    remove(path.c_str());
+    return fails;
+}
+
+int main(int argc, char **argv) {
+    string scratch_directory = argc > 1 ? argv[1] : ".";
+    const char * policy_name[3] = {"farthest", "oldest", "least queried"};
+    int failed_checks = 0;
+    for (int policy = EVICT_FARTHEST; policy <= EVICT_LEAST_QUERIED; policy++){
+        int fails = check_eviction(eviction_policy_set(policy));
+        printf("eviction (%s): %s\n", policy_name[policy], fails == 0 ? "passed" : "FAILED");
+        if (fails > 0) failed_checks ++;
+    }
+    int fails = check_save_load(scratch_directory);
+    printf("save and load: %s\n", fails == 0 ? "passed" : "FAILED");
+    if (fails > 0) failed_checks ++;
+    fails = check_static(scratch_directory);
+    printf("static tree: %s\n", fails == 0 ? "passed" : "FAILED");
+    if (fails > 0) failed_checks ++;
+    fails = check_tiles(scratch_directory);
+    printf("tiled map: %s\n", fails == 0 ? "passed" : "FAILED");
+    if (fails > 0) failed_checks ++;
+    fails = check_journal(scratch_directory);
+    printf("journal recovery: %s\n", fails == 0 ? "passed" : "FAILED");
+    if (fails > 0) failed_checks ++;
+    fails = check_trace(scratch_directory);
+    printf("trace replay: %s\n", fails == 0 ? "passed" : "FAILED");
+    if (fails > 0) failed_checks ++;
+    fails = check_point_file(scratch_directory);
+    printf("point file: %s\n", fails == 0 ? "passed" : "FAILED");
+    if (fails > 0) failed_checks ++;
+    printf("%d checks failed\n", failed_checks);
+    return failed_checks == 0 ? 0 : -1;
+}
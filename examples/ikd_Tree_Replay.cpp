@@ -0,0 +1,82 @@
+/*
+    Description: A benchmark replaying a trace recorded by KD_TREE::start_trace and reporting the latency distribution of every operation
+    Usage: ikd_tree_replay <trace file> [repeat] [sync]
+*/
+#include "ikd_Tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "pcl/point_types.h"
+
+const char * op_name[TRACE_OP_NUM] = {"Build", "Add_Points", "Delete_Points", "Delete_Point_Boxes", "Add_Point_Boxes", "Nearest_Search", "Box_Search", "Radius_Search",
+                                      "Delete_Outside_Box", "Delete_Older_Than", "run_pending_rebuilds", "flush_insert_buffer", "configure"};
+
+double percentile(vector<double> & latency, double ratio){
+    int index = min(int(latency.size() * ratio), int(latency.size()) - 1);
+    return latency[index];
+}
+
+template <typename PointType>
+bool replay(const string & trace_path, int repeat, bool sync){
+    vector<double> latency[TRACE_OP_NUM];
+    typename KD_TREE<PointType>::Trace_File_Header_Type header;
+    FILE * fp = fopen(trace_path.c_str(), "rb");
+    if (fp == nullptr || fread(&header, sizeof(header), 1, fp) != 1){
+        printf("Couldn't read trace %s\n", trace_path.c_str());
+        if (fp != nullptr) fclose(fp);
+        return false;
+    }
+    fclose(fp);
+    /*** The replaying tree is built like the recording one, an executor of the recording application is replaced by the rebuild thread */
+    RebuildPolicyType rebuild_policy;
+    if (header.config.rebuild_mode == SYNC_REBUILD || sync) rebuild_policy.mode = SYNC_REBUILD;
+    for (int r = 0; r < repeat; r++){
+        /*** Every repetition starts from an empty tree, the trace begins with its own Build */
+        typename KD_TREE<PointType>::Ptr kdtree_ptr(new KD_TREE<PointType>(header.config.delete_param, header.config.balance_param, header.config.downsample_size, rebuild_policy));
+        bool success = kdtree_ptr->replay_trace(trace_path, [&](trace_op_set op, double latency_us){
+            latency[op].push_back(latency_us);
+        });
+        if (!success){
+            printf("Failed to replay %s\n", trace_path.c_str());
+            return false;
+        }
+    }
+    printf("%-20s %10s %12s %12s %12s %12s %12s\n", "operation", "calls", "mean (us)", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+    for (int op = 0; op < TRACE_OP_NUM; op++){
+        if (latency[op].empty()) continue;
+        double total = 0.0;
+        for (int i = 0; i < latency[op].size(); i++) total += latency[op][i];
+        sort(latency[op].begin(), latency[op].end());
+        printf("%-20s %10d %12.3f %12.3f %12.3f %12.3f %12.3f\n", op_name[op], int(latency[op].size()), total / latency[op].size(),
+               percentile(latency[op], 0.5), percentile(latency[op], 0.9), percentile(latency[op], 0.99), latency[op].back());
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2){
+        printf("Usage: %s <trace file> [repeat] [sync]\n", argv[0]);
+        return -1;
+    }
+    string trace_path = argv[1];
+    int repeat = argc > 2 ? max(atoi(argv[2]), 1) : 1;
+    bool sync = argc > 3 && strcmp(argv[3], "sync") == 0;
+
+    /*** The point type of the recording tree is told apart by its size */
+    KD_TREE<pcl::PointXYZ>::Trace_File_Header_Type header;
+    FILE * fp = fopen(trace_path.c_str(), "rb");
+    if (fp == nullptr || fread(&header, sizeof(header), 1, fp) != 1){
+        printf("Couldn't read trace %s\n", trace_path.c_str());
+        if (fp != nullptr) fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    bool success = false;
+    if (header.point_size == sizeof(ikdTree_PointType)) success = replay<ikdTree_PointType>(trace_path, repeat, sync);
+    else if (header.point_size == sizeof(pcl::PointXYZ)) success = replay<pcl::PointXYZ>(trace_path, repeat, sync);
+    else if (header.point_size == sizeof(pcl::PointXYZI)) success = replay<pcl::PointXYZI>(trace_path, repeat, sync);
+    else if (header.point_size == sizeof(pcl::PointXYZINormal)) success = replay<pcl::PointXYZINormal>(trace_path, repeat, sync);
+    else printf("Unsupported point size %u in trace %s\n", header.point_size, trace_path.c_str());
+    return success ? 0 : -1;
+}
@@ -0,0 +1,76 @@
+/*
+    Description: An example to compare the split strategies of ikd-Tree by the nodes visited per k nearest search
+*/
+#include "ikd_Tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+#include <algorithm>
+#include "pcl/point_types.h"
+#include "pcl/point_cloud.h"
+#include <pcl/io/pcd_io.h>
+
+
+using PointType = pcl::PointXYZ;
+using PointVector = KD_TREE<PointType>::PointVector;
+template class KD_TREE<pcl::PointXYZ>;
+
+#define NUM_QUERY 20000
+#define K_NEAREST 5
+
+int main(int argc, char **argv) {
+    /*** 1. Load point cloud data */
+    pcl::PointCloud<PointType>::Ptr src(new pcl::PointCloud<PointType>);
+    string filename = "../materials/hku_demo_pointcloud.pcd";
+    if (pcl::io::loadPCDFile<PointType>(filename, *src) == -1) //* load the file
+    {
+        PCL_ERROR ("Couldn't read file hku_demo_pointcloud.pcd \n");
+        return (-1);
+    }
+    printf("Original: %d points are loaded\n", static_cast<int>(src->points.size()));
+
+    /*** 2. Generate queries around the map points */
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> pick(0, src->points.size() - 1);
+    std::normal_distribution<float> noise(0.0f, 0.5f);
+    PointVector queries;
+    for (int i = 0; i < NUM_QUERY; i++){
+        PointType query = src->points[pick(gen)];
+        query.x += noise(gen);
+        query.y += noise(gen);
+        query.z += noise(gen);
+        queries.push_back(query);
+    }
+
+    /*** 3. Build with every split strategy and search the same queries */
+    const char * strategy_name[3] = {"median", "sliding midpoint", "surface area"};
+    split_strategy_set strategies[3] = {SPLIT_MEDIAN, SPLIT_SLIDING_MIDPOINT, SPLIT_SURFACE_AREA};
+    vector<float> reference_dist(NUM_QUERY);
+    for (int s = 0; s < 3; s++){
+        KD_TREE<PointType>::Ptr kdtree_ptr(new KD_TREE<PointType>(0.3, 0.6, 0.2));
+        KD_TREE<PointType> &ikd_Tree = *kdtree_ptr;
+        ikd_Tree.set_split_strategy(strategies[s]);
+        ikd_Tree.set_search_visit_stats(true);
+        auto start = chrono::high_resolution_clock::now();
+        ikd_Tree.Build((*src).points);
+        auto end = chrono::high_resolution_clock::now();
+        float build_time = chrono::duration_cast<chrono::microseconds>(end - start).count() / 1e3;
+
+        PointVector search_result;
+        vector<float> PointDist;
+        int mismatch = 0;
+        long long search_num, visit_num;
+        ikd_Tree.search_visit_stats(search_num, visit_num, true);
+        start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < NUM_QUERY; i++){
+            ikd_Tree.Nearest_Search(queries[i], K_NEAREST, search_result, PointDist);
+            if (s == 0) reference_dist[i] = PointDist.back();
+            else if (fabs(PointDist.back() - reference_dist[i]) > 1e-6) mismatch ++;
+        }
+        end = chrono::high_resolution_clock::now();
+        float search_time = chrono::duration_cast<chrono::microseconds>(end - start).count() / 1e3;
+        ikd_Tree.search_visit_stats(search_num, visit_num);
+        printf("%-17s: build %0.3f ms, %0.2f nodes visited and %0.3f us per %d-NN search, %d mismatches\n", strategy_name[s], build_time, double(visit_num) / search_num, search_time * 1e3 / NUM_QUERY, K_NEAREST, mismatch);
+    }
+    return 0;
+}
@@ -200,6 +200,7 @@ int main(int argc, char** argv){
     PointType target; 
     // Initialize k-d tree
     generate_initial_point_cloud(Point_Num);
+    ikd_Tree.set_removed_points_recording(true);
     auto t1 = chrono::high_resolution_clock::now();
     ikd_Tree.Build(point_cloud);    
     auto t2 = chrono::high_resolution_clock::now();    
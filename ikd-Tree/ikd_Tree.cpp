@@ -6,50 +6,269 @@ Author: Yixi Cai
 email: yixicai@connect.hku.hk
 */
 
-template <typename PointType>
-KD_TREE<PointType>::KD_TREE(float delete_param, float balance_param, float box_length) {
+template <typename PointType, typename ThreadPolicy>
+KD_TREE<PointType, ThreadPolicy>::KD_TREE(float delete_param, float balance_param, float box_length, RebuildPolicyType rebuild_policy) {
     delete_criterion_param = delete_param;
     balance_criterion_param = balance_param;
     downsample_size = box_length;
+    Rebuild_Policy = rebuild_policy;
+    if (ThreadPolicy::Multi_Thread && Rebuild_Policy.mode == EXECUTOR_REBUILD && !Rebuild_Policy.executor) throw "Error: EXECUTOR_REBUILD requires an executor\n";
     Rebuild_Logger.clear();           
     termination_flag = false;
+    reset_latency_stats();
     start_thread();
 }
 
-template <typename PointType>
-KD_TREE<PointType>::~KD_TREE()
+template <typename PointType, typename ThreadPolicy>
+KD_TREE<PointType, ThreadPolicy>::~KD_TREE()
 {
+    close_journal();
+    stop_trace();
     stop_thread();
     Delete_Storage_Disabled = true;
     delete_tree_nodes(&Root_Node);
+    release_node_pool(Node_Pool, 0);
+    release_node_pool(Background_Node_Pool, 0);
+    delete STATIC_ROOT_NODE;
     PointVector ().swap(PCL_Storage);
     Rebuild_Logger.clear();           
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Set_delete_criterion_param(float delete_param){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Set_delete_criterion_param(float delete_param){
     delete_criterion_param = delete_param;
+    Trace_Configure();
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Set_balance_criterion_param(float balance_param){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Set_balance_criterion_param(float balance_param){
     balance_criterion_param = balance_param;
+    Trace_Configure();
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::set_downsample_param(float downsample_param){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Set_minimal_unbalanced_tree_size(int tree_size){
+    minimal_unbalanced_tree_size = max(tree_size, 1);
+    Trace_Configure();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Set_multi_thread_rebuild_point_num(int point_num){
+    multi_thread_rebuild_point_num = max(point_num, 1);
+    Trace_Configure();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_adaptive_rebuild(bool enable){
+    Adaptive_Rebuild = enable;
+    Rebuild_Time_Total = 0;
+    Rebuild_Point_Total = 0;
+    Query_Time_Total = 0;
+    Query_Level_Total = 0;
+    Query_Num = 0;
+    Update_Num = 0;
+    Trace_Configure();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::rebuild_cost_model(double &rebuild_cost_per_point, double &query_cost_per_level, double &traversals_per_update){
+    long long rebuild_points = Rebuild_Point_Total, query_levels = Query_Level_Total, updates = Update_Num;
+    rebuild_cost_per_point = rebuild_points > 0 ? double(Rebuild_Time_Total) / rebuild_points : 0.0;
+    query_cost_per_level = query_levels > 0 ? double(Query_Time_Total) / query_levels : 0.0;
+    traversals_per_update = updates > 0 ? double(Query_Num + updates) / updates : 0.0;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_downsample_param(float downsample_param){
     downsample_size = downsample_param;
+    if (Voxel_Index_Enabled) set_voxel_index(true);
+    Trace_Configure();
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::InitializeKDTree(float delete_param, float balance_param, float box_length){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_split_strategy(split_strategy_set strategy){
+    Split_Strategy = strategy;
+    Trace_Configure();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_search_visit_stats(bool enable){
+    Search_Visit_Stats_Enabled = enable;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::search_visit_stats(long long & search_num, long long & visit_num, bool reset){
+    search_num = Search_Num;
+    visit_num = Search_Visit_Num;
+    if (reset){
+        Search_Num = 0;
+        Search_Visit_Num = 0;
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::latency_stats(latency_op_set op, LatencyStatsType & stats){
+    stats = LatencyStatsType();
+#if LATENCY_STATS_SWITCH
+    if (op < 0 || op >= LATENCY_OP_NUM) return false;
+    const Latency_Histogram_Type & histogram = Latency_Histograms[op];
+    stats.count = histogram.count.load(memory_order_relaxed);
+    if (stats.count == 0) return true;
+    stats.mean_us = histogram.total_ns.load(memory_order_relaxed) / 1e3 / stats.count;
+    stats.max_us = histogram.max_ns.load(memory_order_relaxed) / 1e3;
+    // The buckets are read without stopping the writers, ranks are taken against the bucket total
+    long long bucket_num[Latency_Bucket_Num], total_num = 0;
+    for (int i = 0; i < Latency_Bucket_Num; i++){
+        bucket_num[i] = histogram.bucket[i].load(memory_order_relaxed);
+        total_num += bucket_num[i];
+    }
+    const double ratio[4] = {0.5, 0.9, 0.99, 0.999};
+    double * percentile[4] = {&stats.p50_us, &stats.p90_us, &stats.p99_us, &stats.p999_us};
+    const int half_num = 1 << (Latency_Sub_Bucket_Bits - 1);
+    for (int k = 0; k < 4; k++){
+        long long rank = max((long long)ceil(ratio[k] * total_num), 1LL), counted = 0;
+        int i = 0;
+        while (i < Latency_Bucket_Num - 1 && counted + bucket_num[i] < rank) counted += bucket_num[i++];
+        long long upper_ns = i;
+        if (i >= 2 * half_num){
+            int shift = i / half_num - 1;
+            upper_ns = ((long long)(i - shift * half_num + 1) << shift) - 1;
+        }
+        *percentile[k] = min(upper_ns / 1e3, stats.max_us);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::reset_latency_stats(){
+#if LATENCY_STATS_SWITCH
+    for (int op = 0; op < LATENCY_OP_NUM; op++){
+        Latency_Histogram_Type & histogram = Latency_Histograms[op];
+        histogram.count = 0;
+        histogram.total_ns = 0;
+        histogram.max_ns = 0;
+        for (int i = 0; i < Latency_Bucket_Num; i++) histogram.bucket[i] = 0;
+    }
+#endif
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::rebuild_stats(RebuildStatsType & stats, bool reset){
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&rebuild_stats_mutex_lock);
+    stats = Rebuild_Stats;
+    if (reset) Rebuild_Stats = RebuildStatsType();
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&rebuild_stats_mutex_lock);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_rebuild_callback(function<void(const RebuildEventType &)> callback){
+    // The callback runs on the thread that performs the rebuild, which is the rebuild thread or executor for large subtrees
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&rebuild_stats_mutex_lock);
+    Rebuild_Callback = callback;
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&rebuild_stats_mutex_lock);
+}
+
+template <typename PointType, typename ThreadPolicy>
+rebuild_trigger_set KD_TREE<PointType, ThreadPolicy>::Rebuild_Trigger_of(KD_TREE_NODE * root){
+    // Rebuild follows a passed Criterion_Check, which tests the delete criterion first
+    if (float(root->invalid_point_num) / root->TreeSize > delete_criterion_param) return REBUILD_DELETE_CRITERION;
+    return REBUILD_BALANCE_CRITERION;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Record_Rebuild(const RebuildEventType & event){
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&rebuild_stats_mutex_lock);
+    if (event.background) Rebuild_Stats.background_num ++;
+        else Rebuild_Stats.inline_num ++;
+    if (event.trigger == REBUILD_DELETE_CRITERION) Rebuild_Stats.delete_triggered_num ++;
+        else Rebuild_Stats.balance_triggered_num ++;
+    Rebuild_Stats.rebuilt_point_num += event.tree_size;
+    Rebuild_Stats.max_tree_size = max(Rebuild_Stats.max_tree_size, event.tree_size);
+    Rebuild_Stats.flatten_us += event.flatten_us;
+    Rebuild_Stats.build_us += event.build_us;
+    Rebuild_Stats.replay_us += event.replay_us;
+    Rebuild_Stats.swap_block_us += event.swap_block_us;
+    Rebuild_Stats.max_swap_block_us = max(Rebuild_Stats.max_swap_block_us, event.swap_block_us);
+    Rebuild_Stats.replayed_ops += event.replayed_ops;
+    Rebuild_Stats.max_logger_size = max(Rebuild_Stats.max_logger_size, event.logger_peak);
+    function<void(const RebuildEventType &)> callback = Rebuild_Callback;
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&rebuild_stats_mutex_lock);
+    if (callback) callback(event);
+}
+
+#if LATENCY_STATS_SWITCH
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Latency_Record(latency_op_set op, long long latency_ns){
+    Latency_Histogram_Type & histogram = Latency_Histograms[op];
+    unsigned long long value = max(latency_ns, 0LL);
+    int index = value;
+    if (value >= (1ULL << Latency_Sub_Bucket_Bits)){
+        int shift = 63 - __builtin_clzll(value) - (Latency_Sub_Bucket_Bits - 1);
+        index = (shift << (Latency_Sub_Bucket_Bits - 1)) + int(value >> shift);
+    }
+    histogram.bucket[index].fetch_add(1, memory_order_relaxed);
+    histogram.count.fetch_add(1, memory_order_relaxed);
+    histogram.total_ns.fetch_add(value, memory_order_relaxed);
+    long long max_ns = histogram.max_ns.load(memory_order_relaxed);
+    while ((long long)value > max_ns && !histogram.max_ns.compare_exchange_weak(max_ns, value, memory_order_relaxed));
+}
+#endif
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_insert_buffer(int buffer_size){
+    Insert_Buffer_Size = max(buffer_size, 0);
+    if (Insert_Buffer.size() >= Insert_Buffer_Size) Merge_Insert_Buffer();
+    Trace_Configure();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_voxel_index(bool enable){
+    Voxel_Index_Enabled = enable;
+    Voxel_Index.clear();
+    Trace_Configure();
+    if (!enable || Root_Node == nullptr) return;
+    PointVector points;
+    flatten(Root_Node, points, NOT_RECORD);
+    for (int i = 0; i < points.size(); i++) Voxel_Index_Insert(points[i]);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_point_timestamp(function<double(const PointType &)> timestamp_of){
+    Point_Timestamp = timestamp_of;
+    if (Point_Timestamp) Rebuild_Time_Range(Root_Node);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_capacity(int max_points, eviction_policy_set policy){
+    if (policy == EVICT_OLDEST && max_points > 0 && !Point_Timestamp) throw "Error: EVICT_OLDEST requires set_point_timestamp\n";
+    Max_Point_Num = max(max_points, 0);
+    Eviction_Policy = policy;
+    if (Max_Point_Num > 0 && policy == EVICT_LEAST_QUERIED){
+        if (!Query_Stamps) Query_Stamps.reset(new atomic<int>[Query_Stamp_Table_Size]());
+    } else {
+        Query_Stamps.reset();
+    }
+    Trace_Configure();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_eviction_center(PointType center){
+    Eviction_Center = center;
+    Trace_Configure();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::InitializeKDTree(float delete_param, float balance_param, float box_length){
     Set_delete_criterion_param(delete_param);
     Set_balance_criterion_param(balance_param);
     set_downsample_param(box_length);
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE * root){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::InitTreeNode(KD_TREE_NODE * root){
     root->point.x = 0.0f;
     root->point.y = 0.0f;
     root->point.z = 0.0f;       
@@ -59,6 +278,8 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE * root){
     root->node_range_y[1] = 0.0f;    
     root->node_range_z[0] = 0.0f;
     root->node_range_z[1] = 0.0f;     
+    root->time_min = INFINITY;
+    root->time_max = -INFINITY;
     root->division_axis = 0;
     root->father_ptr = nullptr;
     root->left_son_ptr = nullptr;
@@ -72,33 +293,34 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE * root){
     root->need_push_down_to_right = false;
     root->point_downsample_deleted = false;
     root->working_flag = false;
-    pthread_mutex_init(&(root->push_down_mutex_lock),NULL);
+    root->rebuild_pending = false;
+    root->tree_rebuild_pending = false;
 }   
 
-template <typename PointType>
-int KD_TREE<PointType>::size(){
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::size(){
     int s = 0;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
+    if (!in_background_rebuild(Root_Node)){
         if (Root_Node != nullptr) {
-            return Root_Node->TreeSize;
+            return Root_Node->TreeSize + Insert_Buffer.size();
         } else {
-            return 0;
+            return Insert_Buffer.size();
         }
     } else {
         if (!pthread_mutex_trylock(&working_flag_mutex)){
             s = Root_Node->TreeSize;
             pthread_mutex_unlock(&working_flag_mutex);
-            return s;
+            return s + Insert_Buffer.size();
         } else {
-            return Treesize_tmp;
+            return Treesize_tmp + Insert_Buffer.size();
         }
     }
 }
 
-template <typename PointType>
-BoxPointType KD_TREE<PointType>::tree_range(){
+template <typename PointType, typename ThreadPolicy>
+BoxPointType KD_TREE<PointType, ThreadPolicy>::tree_range(){
     BoxPointType range;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
+    if (!in_background_rebuild(Root_Node)){
         if (Root_Node != nullptr) {
             range.vertex_min[0] = Root_Node->node_range_x[0];
             range.vertex_min[1] = Root_Node->node_range_y[0];
@@ -125,28 +347,28 @@ BoxPointType KD_TREE<PointType>::tree_range(){
     return range;
 }
 
-template <typename PointType>
-int KD_TREE<PointType>::validnum(){
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::validnum(){
     int s = 0;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
+    if (!in_background_rebuild(Root_Node)){
         if (Root_Node != nullptr)
-            return (Root_Node->TreeSize - Root_Node->invalid_point_num);
+            return (Root_Node->TreeSize - Root_Node->invalid_point_num + Insert_Buffer.size());
         else 
-            return 0;
+            return Insert_Buffer.size();
     } else {
         if (!pthread_mutex_trylock(&working_flag_mutex)){
             s = Root_Node->TreeSize-Root_Node->invalid_point_num;
             pthread_mutex_unlock(&working_flag_mutex);
-            return s;
+            return s + Insert_Buffer.size();
         } else {
             return -1;
         }
     }
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::root_alpha(float &alpha_bal, float &alpha_del){
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::root_alpha(float &alpha_bal, float &alpha_del){
+    if (!in_background_rebuild(Root_Node)){
         alpha_bal = Root_Node->alpha_bal;
         alpha_del = Root_Node->alpha_del;
         return;
@@ -164,158 +386,243 @@ void KD_TREE<PointType>::root_alpha(float &alpha_bal, float &alpha_del){
     }    
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::start_thread(){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::start_thread(){
+    if (!ThreadPolicy::Multi_Thread) return;
     pthread_mutex_init(&termination_flag_mutex_lock, NULL);   
     pthread_mutex_init(&rebuild_ptr_mutex_lock, NULL);     
     pthread_mutex_init(&rebuild_logger_mutex_lock, NULL);
     pthread_mutex_init(&points_deleted_rebuild_mutex_lock, NULL); 
     pthread_mutex_init(&working_flag_mutex, NULL);
     pthread_mutex_init(&search_flag_mutex, NULL);
-    pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void*) this);
+    pthread_cond_init(&rebuild_task_cond, NULL);
+    pthread_mutex_init(&trace_mutex_lock, NULL);
+    pthread_mutex_init(&rebuild_stats_mutex_lock, NULL);
+    if (Rebuild_Policy.mode != MULTI_THREAD_REBUILD) return;
+    // The requested affinity and scheduling class are not optional, a thread that cannot get them is not started at all
+    pthread_attr_t attr;
+    int retval = pthread_attr_init(&attr);
+    if (retval == 0 && !Rebuild_Policy.cpu_affinity.empty()){
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (int i = 0; i < Rebuild_Policy.cpu_affinity.size(); i++){
+            if (Rebuild_Policy.cpu_affinity[i] < 0 || Rebuild_Policy.cpu_affinity[i] >= CPU_SETSIZE) retval = EINVAL;
+                else CPU_SET(Rebuild_Policy.cpu_affinity[i], &cpu_set);
+        }
+        if (retval == 0) retval = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+    }
+    if (retval == 0 && Rebuild_Policy.sched_policy >= 0){
+        struct sched_param param;
+        param.sched_priority = Rebuild_Policy.sched_priority;
+        retval = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (retval == 0) retval = pthread_attr_setschedpolicy(&attr, Rebuild_Policy.sched_policy);
+        if (retval == 0) retval = pthread_attr_setschedparam(&attr, &param);
+    }
+    if (retval == 0) retval = pthread_create(&rebuild_thread, &attr, multi_thread_ptr, (void*) this);
+    pthread_attr_destroy(&attr);
+    rebuild_thread_started = (retval == 0);
+    if (!rebuild_thread_started){
+        printf("Failed to start rebuild thread with the requested policy (error %d)\n", retval);
+        stop_thread();
+        throw "Error: Failed to start rebuild thread with the requested policy\n";
+    }
     printf("Multi thread started \n");    
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::stop_thread(){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::stop_thread(){
+    if (!ThreadPolicy::Multi_Thread) return;
     pthread_mutex_lock(&termination_flag_mutex_lock);
     termination_flag = true;
     pthread_mutex_unlock(&termination_flag_mutex_lock);
-    if (rebuild_thread) pthread_join(rebuild_thread, NULL);
+    if (rebuild_thread_started) pthread_join(rebuild_thread, NULL);
+    // A task handed to the executor still references this tree, wait for it to finish.
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    while (rebuild_task_pending) pthread_cond_wait(&rebuild_task_cond, &rebuild_ptr_mutex_lock);
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
     pthread_mutex_destroy(&termination_flag_mutex_lock);
     pthread_mutex_destroy(&rebuild_logger_mutex_lock);
     pthread_mutex_destroy(&rebuild_ptr_mutex_lock);
     pthread_mutex_destroy(&points_deleted_rebuild_mutex_lock);
+    pthread_mutex_destroy(&trace_mutex_lock);
+    pthread_mutex_destroy(&rebuild_stats_mutex_lock);
     pthread_mutex_destroy(&working_flag_mutex);
     pthread_mutex_destroy(&search_flag_mutex);     
+    pthread_cond_destroy(&rebuild_task_cond);
 }
 
-template <typename PointType>
-void * KD_TREE<PointType>::multi_thread_ptr(void * arg){
+template <typename PointType, typename ThreadPolicy>
+void * KD_TREE<PointType, ThreadPolicy>::multi_thread_ptr(void * arg){
     KD_TREE * handle = (KD_TREE*) arg;
     handle->multi_thread_rebuild();
     return nullptr;    
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::multi_thread_rebuild(){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::multi_thread_rebuild(){
     bool terminated = false;
-    KD_TREE_NODE * father_ptr, ** new_node_ptr;
     pthread_mutex_lock(&termination_flag_mutex_lock);
     terminated = termination_flag;
     pthread_mutex_unlock(&termination_flag_mutex_lock);
     while (!terminated){
         pthread_mutex_lock(&rebuild_ptr_mutex_lock);
-        pthread_mutex_lock(&working_flag_mutex);
-        if (Rebuild_Ptr != nullptr ){                    
-            /* Traverse and copy */
-            if (!Rebuild_Logger.empty()){
-                printf("\n\n\n\n\n\n\n\n\n\n\n ERROR!!! \n\n\n\n\n\n\n\n\n");
-            }
-            rebuild_flag = true;
-            if (*Rebuild_Ptr == Root_Node) {
-                Treesize_tmp = Root_Node->TreeSize;
-                Validnum_tmp = Root_Node->TreeSize - Root_Node->invalid_point_num;
-                alpha_bal_tmp = Root_Node->alpha_bal;
-                alpha_del_tmp = Root_Node->alpha_del;
-            }
-            KD_TREE_NODE * old_root_node = (*Rebuild_Ptr);                            
-            father_ptr = (*Rebuild_Ptr)->father_ptr;  
-            PointVector ().swap(Rebuild_PCL_Storage);
-            // Lock Search 
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0){
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);             
-                pthread_mutex_lock(&search_flag_mutex);
-            }
-            search_mutex_counter = -1;
+        background_rebuild();
+        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);         
+        pthread_mutex_lock(&termination_flag_mutex_lock);
+        terminated = termination_flag;
+        pthread_mutex_unlock(&termination_flag_mutex_lock);
+        usleep(100); 
+    }
+    printf("Rebuild thread terminated normally\n");    
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::executor_rebuild(){
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    background_rebuild();
+    rebuild_task_pending = false;
+    pthread_cond_signal(&rebuild_task_cond);
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::background_rebuild(){
+    KD_TREE_NODE * father_ptr;
+    pthread_mutex_lock(&working_flag_mutex);
+    if (Rebuild_Ptr != nullptr ){                    
+        /* Traverse and copy */
+        if (!Rebuild_Logger.empty()){
+            printf("\n\n\n\n\n\n\n\n\n\n\n ERROR!!! \n\n\n\n\n\n\n\n\n");
+        }
+        rebuild_flag = true;
+        if (*Rebuild_Ptr == Root_Node) {
+            Treesize_tmp = Root_Node->TreeSize;
+            Validnum_tmp = Root_Node->TreeSize - Root_Node->invalid_point_num;
+            alpha_bal_tmp = Root_Node->alpha_bal;
+            alpha_del_tmp = Root_Node->alpha_del;
+        }
+        RebuildEventType event;
+        event.background = true;
+        event.trigger = Rebuild_Trigger;
+        auto event_start = chrono::high_resolution_clock::now();
+        KD_TREE_NODE * old_root_node = (*Rebuild_Ptr);                            
+        father_ptr = (*Rebuild_Ptr)->father_ptr;  
+        PointVector ().swap(Rebuild_PCL_Storage);
+        // Lock Search 
+        pthread_mutex_lock(&search_flag_mutex);
+        while (search_mutex_counter != 0){
             pthread_mutex_unlock(&search_flag_mutex);
-            // Lock deleted points cache
-            pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);    
-            flatten(*Rebuild_Ptr, Rebuild_PCL_Storage, MULTI_THREAD_REC);
-            // Unlock deleted points cache
-            pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
-            // Unlock Search
+            usleep(1);             
             pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);              
-            pthread_mutex_unlock(&working_flag_mutex);   
-            /* Rebuild and update missed operations*/
-            Operation_Logger_Type Operation;
-            KD_TREE_NODE * new_root_node = nullptr;  
-            if (int(Rebuild_PCL_Storage.size()) > 0){
-                BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size()-1, Rebuild_PCL_Storage);
-                // Rebuild has been done. Updates the blocked operations into the new tree
+        }
+        search_mutex_counter = -1;
+        pthread_mutex_unlock(&search_flag_mutex);
+        // Lock deleted points cache
+        pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);    
+        int size_rec = (*Rebuild_Ptr)->TreeSize;
+        auto rebuild_start = chrono::high_resolution_clock::now();
+        flatten(*Rebuild_Ptr, Rebuild_PCL_Storage, Removed_Points_Enabled ? MULTI_THREAD_REC : NOT_RECORD);
+        long long rebuild_time = chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - rebuild_start).count();
+        event.tree_size = size_rec;
+        event.valid_size = Rebuild_PCL_Storage.size();
+        event.flatten_us = rebuild_time / 1e3;
+        PointVector removed_points;
+        function<void(const PointVector &)> removed_points_callback = Removed_Points_Callback;
+        if (removed_points_callback) removed_points.swap(Multithread_Points_deleted);
+        // Unlock deleted points cache
+        pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+        // Unlock Search
+        pthread_mutex_lock(&search_flag_mutex);
+        search_mutex_counter = 0;
+        pthread_mutex_unlock(&search_flag_mutex);              
+        pthread_mutex_unlock(&working_flag_mutex);   
+        if (!removed_points.empty()) removed_points_callback(removed_points);
+        /* Rebuild and update missed operations*/
+        Operation_Logger_Type Operation;
+        KD_TREE_NODE * new_root_node = nullptr;  
+        if (int(Rebuild_PCL_Storage.size()) > 0){
+            rebuild_start = chrono::high_resolution_clock::now();
+            BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size()-1, Rebuild_PCL_Storage, &Background_Node_Pool);
+            long long build_time = chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - rebuild_start).count();
+            rebuild_time += build_time;
+            event.build_us = build_time / 1e3;
+            // Rebuild has been done. Updates the blocked operations into the new tree
+            auto replay_start = chrono::high_resolution_clock::now();
+            pthread_mutex_lock(&working_flag_mutex);
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            int tmp_counter = 0;
+            while (!Rebuild_Logger.empty()){
+                Operation = Rebuild_Logger.front();
+                max_queue_size = max(max_queue_size, Rebuild_Logger.size());
+                event.logger_peak = max(event.logger_peak, int(Rebuild_Logger.size()));
+                Rebuild_Logger.pop();
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);                  
+                pthread_mutex_unlock(&working_flag_mutex);
+                run_operation(&new_root_node, Operation);
+                tmp_counter ++;
+                if (tmp_counter % 10 == 0) usleep(1);
                 pthread_mutex_lock(&working_flag_mutex);
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                int tmp_counter = 0;
-                while (!Rebuild_Logger.empty()){
-                    Operation = Rebuild_Logger.front();
-                    max_queue_size = max(max_queue_size, Rebuild_Logger.size());
-                    Rebuild_Logger.pop();
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);                  
-                    pthread_mutex_unlock(&working_flag_mutex);
-                    run_operation(&new_root_node, Operation);
-                    tmp_counter ++;
-                    if (tmp_counter % 10 == 0) usleep(1);
-                    pthread_mutex_lock(&working_flag_mutex);
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);               
-                }   
-               pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-            }  
-            /* Replace to original tree*/          
-            // pthread_mutex_lock(&working_flag_mutex);
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0){
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);             
-                pthread_mutex_lock(&search_flag_mutex);
-            }
-            search_mutex_counter = -1;
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);               
+            }   
+           pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+           event.replayed_ops = tmp_counter;
+           event.replay_us = chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - replay_start).count() / 1e3;
+        }  
+        /* Replace to original tree*/          
+        // pthread_mutex_lock(&working_flag_mutex);
+        pthread_mutex_lock(&search_flag_mutex);
+        while (search_mutex_counter != 0){
             pthread_mutex_unlock(&search_flag_mutex);
-            if (father_ptr->left_son_ptr == *Rebuild_Ptr) {
-                father_ptr->left_son_ptr = new_root_node;
-            } else if (father_ptr->right_son_ptr == *Rebuild_Ptr){             
-                father_ptr->right_son_ptr = new_root_node;
-            } else {
-                throw "Error: Father ptr incompatible with current node\n";
-            }
-            if (new_root_node != nullptr) new_root_node->father_ptr = father_ptr;
-            (*Rebuild_Ptr) = new_root_node;
-            int valid_old = old_root_node->TreeSize-old_root_node->invalid_point_num;
-            int valid_new = new_root_node->TreeSize-new_root_node->invalid_point_num;
-            if (father_ptr == STATIC_ROOT_NODE) Root_Node = STATIC_ROOT_NODE->left_son_ptr;
-            KD_TREE_NODE * update_root = *Rebuild_Ptr;
-            while (update_root != nullptr && update_root != Root_Node){
-                update_root = update_root->father_ptr;
-                if (update_root->working_flag) break;
-                if (update_root == update_root->father_ptr->left_son_ptr && update_root->father_ptr->need_push_down_to_left) break;
-                if (update_root == update_root->father_ptr->right_son_ptr && update_root->father_ptr->need_push_down_to_right) break;
-                Update(update_root);
-            }
+            usleep(1);             
             pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
-            Rebuild_Ptr = nullptr;
-            pthread_mutex_unlock(&working_flag_mutex);
-            rebuild_flag = false;                     
-            /* Delete discarded tree nodes */
-            delete_tree_nodes(&old_root_node);
+        }
+        search_mutex_counter = -1;
+        pthread_mutex_unlock(&search_flag_mutex);
+        auto swap_start = chrono::high_resolution_clock::now();
+        if (father_ptr->left_son_ptr == *Rebuild_Ptr) {
+            father_ptr->left_son_ptr = new_root_node;
+        } else if (father_ptr->right_son_ptr == *Rebuild_Ptr){             
+            father_ptr->right_son_ptr = new_root_node;
         } else {
-            pthread_mutex_unlock(&working_flag_mutex);             
+            throw "Error: Father ptr incompatible with current node\n";
         }
-        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);         
-        pthread_mutex_lock(&termination_flag_mutex_lock);
-        terminated = termination_flag;
-        pthread_mutex_unlock(&termination_flag_mutex_lock);
-        usleep(100); 
+        if (new_root_node != nullptr) new_root_node->father_ptr = father_ptr;
+        (*Rebuild_Ptr) = new_root_node;
+        int valid_old = old_root_node->TreeSize-old_root_node->invalid_point_num;
+        int valid_new = new_root_node->TreeSize-new_root_node->invalid_point_num;
+        if (father_ptr == STATIC_ROOT_NODE) Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+        KD_TREE_NODE * update_root = *Rebuild_Ptr;
+        while (update_root != nullptr && update_root != Root_Node){
+            update_root = update_root->father_ptr;
+            if (update_root->working_flag) break;
+            if (update_root == update_root->father_ptr->left_son_ptr && update_root->father_ptr->need_push_down_to_left) break;
+            if (update_root == update_root->father_ptr->right_son_ptr && update_root->father_ptr->need_push_down_to_right) break;
+            Update(update_root);
+        }
+        pthread_mutex_lock(&search_flag_mutex);
+        search_mutex_counter = 0;
+        pthread_mutex_unlock(&search_flag_mutex);
+        event.swap_block_us = chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - swap_start).count() / 1e3;
+        Rebuild_Ptr = nullptr;
+        rebuild_flag = false;                     
+        pthread_mutex_unlock(&working_flag_mutex);
+        Rebuild_Time_Total += rebuild_time;
+#if LATENCY_STATS_SWITCH
+        Latency_Record(LATENCY_REBUILD, rebuild_time);
+#endif
+        Rebuild_Point_Total += size_rec;
+        /* Keep discarded tree nodes for the next background rebuild */
+        recycle_tree_nodes(&old_root_node, Background_Node_Pool);
+        release_node_pool(Background_Node_Pool, Max_Recycled_Node_Num);
+        event.total_us = chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - event_start).count() / 1e3;
+        Record_Rebuild(event);
+    } else {
+        pthread_mutex_unlock(&working_flag_mutex);             
     }
-    printf("Rebuild thread terminated normally\n");    
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::run_operation(KD_TREE_NODE ** root, Operation_Logger_Type operation){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::run_operation(KD_TREE_NODE ** root, Operation_Logger_Type operation){
     switch (operation.op)
     {
     case ADD_POINT:      
@@ -333,6 +640,12 @@ void KD_TREE<PointType>::run_operation(KD_TREE_NODE ** root, Operation_Logger_Ty
     case DOWNSAMPLE_DELETE:
         Delete_by_range(root, operation.boxpoint, false, true);
         break;
+    case DELETE_OUTSIDE_BOX:
+        Delete_outside_range(root, operation.boxpoint, false, false);
+        break;
+    case DELETE_OLDER_THAN:
+        Delete_older_than(root, operation.timestamp, false, false);
+        break;
     case PUSH_DOWN:
         (*root)->tree_downsample_deleted |= operation.tree_downsample_deleted;
         (*root)->point_downsample_deleted |= operation.tree_downsample_deleted;
@@ -349,27 +662,929 @@ void KD_TREE<PointType>::run_operation(KD_TREE_NODE ** root, Operation_Logger_Ty
     }
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Build(PointVector point_cloud){
-    if (Root_Node != nullptr){
-        delete_tree_nodes(&Root_Node);
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Build(PointVector point_cloud){
+    Trace_Append(TRACE_BUILD, point_cloud.data(), point_cloud.size());
+    Discard_Tree();
+    Insert_Buffer.clear();
+    for (int k = 0; k < 3; k++) Insert_Buffer_Coord[k].clear();
+    if (Voxel_Index_Enabled) Voxel_Index.clear();
+    if (point_cloud.size() == 0){
+        release_node_pool(Node_Pool, Max_Recycled_Node_Num);
+        if (Journal_Fd >= 0 && !checkpoint()) printf("Failed to checkpoint the journal %s\n", Journal_Path.c_str());
+        return;
     }
-    if (point_cloud.size() == 0) return;
-    STATIC_ROOT_NODE = new KD_TREE_NODE;
+    if (STATIC_ROOT_NODE == nullptr) STATIC_ROOT_NODE = new KD_TREE_NODE;
     InitTreeNode(STATIC_ROOT_NODE); 
-    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size()-1, point_cloud);
+    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size()-1, point_cloud, &Node_Pool);
+    release_node_pool(Node_Pool, Max_Recycled_Node_Num);
     Update(STATIC_ROOT_NODE);
     STATIC_ROOT_NODE->TreeSize = 0;
     Root_Node = STATIC_ROOT_NODE->left_son_ptr;    
+    if (Voxel_Index_Enabled){
+        for (int i = 0; i < point_cloud.size(); i++) Voxel_Index_Insert(point_cloud[i]);
+    }
+    // A rebuilt tree is not described by the journal, start a new one from it
+    if (Journal_Fd >= 0 && !checkpoint()) printf("Failed to checkpoint the journal %s\n", Journal_Path.c_str());
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVector& Nearest_Points, vector<float> & Point_Distance, double max_dist){   
+// Optional fields of a point file are only copied into point types having them
+template <typename T>
+auto set_file_intensity(T & point, float intensity, int) -> decltype(point.intensity = intensity, void()){
+    point.intensity = intensity;
+}
+
+template <typename T>
+void set_file_intensity(T & point, float intensity, long){}
+
+template <typename T>
+auto set_file_normal(T & point, float normal_x, float normal_y, float normal_z, int) -> decltype(point.normal_x = normal_x, void()){
+    point.normal_x = normal_x;
+    point.normal_y = normal_y;
+    point.normal_z = normal_z;
+}
+
+template <typename T>
+void set_file_normal(T & point, float normal_x, float normal_y, float normal_z, long){}
+
+template <typename T>
+auto set_file_curvature(T & point, float curvature, int) -> decltype(point.curvature = curvature, void()){
+    point.curvature = curvature;
+}
+
+template <typename T>
+void set_file_curvature(T & point, float curvature, long){}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::build_from_file(const string & path, point_file_format_set format, int raw_field_num){
+    if (format == POINT_FILE_BY_EXTENSION){
+        string extension = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        format = extension == ".pcd" ? POINT_FILE_PCD : POINT_FILE_RAW;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0){
+        close(fd);
+        return false;
+    }
+    void * data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    Point_File_Type file;
+    if (!Parse_Point_File((const char *) data, file_stat.st_size, format, raw_field_num, file) || file.point_num > INT_MAX){
+        munmap(data, file_stat.st_size);
+        return false;
+    }
+    // Only compact coordinates are gathered from the mapping, points of a non-dense cloud without coordinates are skipped
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+    vector<Build_Point_Type> build_points, build_buffer;
+    build_points.reserve(file.point_num);
+    for (size_t i = 0; i < file.point_num; i++){
+        Build_Point_Type build_point;
+        build_point.coord[0] = Read_File_Field(file, i, FIELD_X);
+        build_point.coord[1] = Read_File_Field(file, i, FIELD_Y);
+        build_point.coord[2] = Read_File_Field(file, i, FIELD_Z);
+        if (!isfinite(build_point.coord[0]) || !isfinite(build_point.coord[1]) || !isfinite(build_point.coord[2])) continue;
+        build_point.index = i;
+        build_points.push_back(build_point);
+    }
+    Discard_Tree();
+    Insert_Buffer.clear();
+    for (int k = 0; k < 3; k++) Insert_Buffer_Coord[k].clear();
+    if (Voxel_Index_Enabled) Voxel_Index.clear();
+    if (!build_points.empty()){
+        int n = build_points.size();
+        vector<Build_Split_Type> splits;
+        splits.reserve(n);
+        if (n >= HistogramSelectMinSize) build_buffer.resize(n);
+        Partition_by_index(0, n-1, build_points, build_buffer, splits);
+        vector<Build_Point_Type> ().swap(build_buffer);
+        // Nodes are created in tree order, which visits the file out of order
+        madvise(data, file_stat.st_size, MADV_RANDOM);
+        if (STATIC_ROOT_NODE == nullptr) STATIC_ROOT_NODE = new KD_TREE_NODE;
+        InitTreeNode(STATIC_ROOT_NODE);
+        PointVector chunk;
+        int split_counter = 0;
+        Build_by_file_splits(&STATIC_ROOT_NODE->left_son_ptr, 0, n-1, file, build_points, splits, split_counter, chunk);
+        Update(STATIC_ROOT_NODE);
+        STATIC_ROOT_NODE->TreeSize = 0;
+        Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+        if (Voxel_Index_Enabled){
+            PointType point;
+            for (int i = 0; i < n; i++){
+                Read_File_Point(file, build_points[i].index, point);
+                Voxel_Index_Insert(point);
+            }
+        }
+    }
+    release_node_pool(Node_Pool, Max_Recycled_Node_Num);
+    munmap(data, file_stat.st_size);
+    // A trace replays the file as a Build of the points it holds
+    if (Trace_File.load() != nullptr){
+        PointVector points;
+        if (Root_Node != nullptr) flatten(Root_Node, points, NOT_RECORD);
+        Trace_Append(TRACE_BUILD, points.data(), points.size());
+    }
+    if (Journal_Fd >= 0 && !checkpoint()) printf("Failed to checkpoint the journal %s\n", Journal_Path.c_str());
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Parse_Point_File(const char * data, size_t file_size, point_file_format_set format, int raw_field_num, Point_File_Type & file){
+    for (int k = 0; k < FIELD_NUM; k++){
+        file.offset[k] = -1;
+        file.size[k] = 0;
+    }
+    if (format == POINT_FILE_RAW){
+        // Headerless records of raw_field_num floats starting with x, y, z and intensity
+        if (raw_field_num < 3) return false;
+        file.data = data;
+        file.stride = raw_field_num * sizeof(float);
+        if (file_size % file.stride != 0) return false;
+        file.point_num = file_size / file.stride;
+        for (int k = 0; k < min(raw_field_num, 4); k++){
+            file.offset[k] = k * sizeof(float);
+            file.size[k] = sizeof(float);
+        }
+        return true;
+    }
+    // PCD header lines up to DATA, only uncompressed binary data can be read in place
+    vector<string> names;
+    vector<int> sizes, counts;
+    vector<char> types;
+    size_t point_num = 0, pos = 0;
+    bool binary = false;
+    while (pos < file_size){
+        size_t end = pos;
+        while (end < file_size && data[end] != '\n') end++;
+        istringstream line(string(data + pos, end - pos));
+        pos = end + 1;
+        string key, value;
+        line >> key;
+        if (key == "FIELDS"){
+            while (line >> value) names.push_back(value);
+        } else if (key == "SIZE"){
+            int size;
+            while (line >> size) sizes.push_back(size);
+        } else if (key == "TYPE"){
+            char type;
+            while (line >> type) types.push_back(type);
+        } else if (key == "COUNT"){
+            int count;
+            while (line >> count) counts.push_back(count);
+        } else if (key == "POINTS"){
+            line >> point_num;
+        } else if (key == "DATA"){
+            line >> value;
+            binary = value == "binary";
+            break;
+        }
+    }
+    if (counts.empty()) counts.assign(names.size(), 1);
+    if (!binary || names.empty() || sizes.size() != names.size() || types.size() != names.size() || counts.size() != names.size()) return false;
+    const char * field_names[FIELD_NUM] = {"x", "y", "z", "intensity", "normal_x", "normal_y", "normal_z", "curvature"};
+    size_t stride = 0;
+    for (int i = 0; i < names.size(); i++){
+        for (int k = 0; k < FIELD_NUM; k++){
+            if (names[i] == field_names[k] && types[i] == 'F' && (sizes[i] == 4 || sizes[i] == 8)){
+                file.offset[k] = stride;
+                file.size[k] = sizes[i];
+            }
+        }
+        stride += size_t(sizes[i]) * counts[i];
+    }
+    if (file.offset[FIELD_X] < 0 || file.offset[FIELD_Y] < 0 || file.offset[FIELD_Z] < 0 || stride == 0) return false;
+    if (pos > file_size || (file_size - pos) / stride < point_num) return false;
+    file.data = data + pos;
+    file.stride = stride;
+    file.point_num = point_num;
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+float KD_TREE<PointType, ThreadPolicy>::Read_File_Field(const Point_File_Type & file, size_t index, int field){
+    // Records are packed, the field may not be aligned
+    const char * field_ptr = file.data + index * file.stride + file.offset[field];
+    if (file.size[field] == sizeof(double)){
+        double value;
+        memcpy(&value, field_ptr, sizeof(double));
+        return float(value);
+    }
+    float value;
+    memcpy(&value, field_ptr, sizeof(float));
+    return value;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Read_File_Point(const Point_File_Type & file, size_t index, PointType & point){
+    point = PointType();
+    point.x = Read_File_Field(file, index, FIELD_X);
+    point.y = Read_File_Field(file, index, FIELD_Y);
+    point.z = Read_File_Field(file, index, FIELD_Z);
+    if (file.offset[FIELD_INTENSITY] >= 0) set_file_intensity(point, Read_File_Field(file, index, FIELD_INTENSITY), 0);
+    if (file.offset[FIELD_NORMAL_X] >= 0 && file.offset[FIELD_NORMAL_Y] >= 0 && file.offset[FIELD_NORMAL_Z] >= 0){
+        set_file_normal(point, Read_File_Field(file, index, FIELD_NORMAL_X), Read_File_Field(file, index, FIELD_NORMAL_Y), Read_File_Field(file, index, FIELD_NORMAL_Z), 0);
+    }
+    if (file.offset[FIELD_CURVATURE] >= 0) set_file_curvature(point, Read_File_Field(file, index, FIELD_CURVATURE), 0);
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::save(const string & path){
+    FILE * fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) return false;
+    Tree_File_Header_Type header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IKDT", 4);
+    header.version = Tree_File_Version;
+    header.point_size = sizeof(PointType);
+    header.node_size = sizeof(Serialized_Node_Type);
+    header.buffer_num = Insert_Buffer.size();
+    bool success = fwrite(&header, sizeof(header), 1, fp) == 1;
+    // Keep a background rebuild from swapping subtrees while they are written
+    if (ThreadPolicy::Multi_Thread){
+        pthread_mutex_lock(&search_flag_mutex);
+        while (search_mutex_counter == -1){
+            pthread_mutex_unlock(&search_flag_mutex);
+            usleep(1);
+            pthread_mutex_lock(&search_flag_mutex);
+        }
+        search_mutex_counter += 1;
+        pthread_mutex_unlock(&search_flag_mutex);
+    }
+    vector<Serialized_Node_Type> chunk;
+    chunk.reserve(Tree_File_Chunk_Size);
+    success = success && Save_Tree(Root_Node, fp, chunk, header.node_num);
+    if (success && !chunk.empty()) success = fwrite(chunk.data(), sizeof(Serialized_Node_Type), chunk.size(), fp) == chunk.size();
+    if (ThreadPolicy::Multi_Thread){
+        pthread_mutex_lock(&search_flag_mutex);
+        search_mutex_counter -= 1;
+        pthread_mutex_unlock(&search_flag_mutex);
+    }
+    if (success && !Insert_Buffer.empty()) success = fwrite(Insert_Buffer.data(), sizeof(PointType), Insert_Buffer.size(), fp) == Insert_Buffer.size();
+    // The node count is only known once the tree has been written
+    if (success) success = fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    success = fclose(fp) == 0 && success;
+    return success;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Save_Tree(KD_TREE_NODE * root, FILE * fp, vector<Serialized_Node_Type> & chunk, int64_t & node_num){
+    if (root == nullptr) return true;
+    Serialized_Node_Type node = Serialized_Node_Type();
+    node.point = root->point;
+    node.node_range[0] = root->node_range_x[0];
+    node.node_range[1] = root->node_range_x[1];
+    node.node_range[2] = root->node_range_y[0];
+    node.node_range[3] = root->node_range_y[1];
+    node.node_range[4] = root->node_range_z[0];
+    node.node_range[5] = root->node_range_z[1];
+    node.radius_sq = root->radius_sq;
+    node.time_min = root->time_min;
+    node.time_max = root->time_max;
+    node.TreeSize = root->TreeSize;
+    node.invalid_point_num = root->invalid_point_num;
+    node.down_del_num = root->down_del_num;
+    node.division_axis = root->division_axis;
+    node.flags = (root->point_deleted << 0) | (root->tree_deleted << 1) | (root->point_downsample_deleted << 2) | (root->tree_downsample_deleted << 3)
+               | (root->need_push_down_to_left << 4) | (root->need_push_down_to_right << 5) | ((root->left_son_ptr != nullptr) << 6) | ((root->right_son_ptr != nullptr) << 7);
+    chunk.push_back(node);
+    node_num ++;
+    if (chunk.size() == Tree_File_Chunk_Size){
+        if (fwrite(chunk.data(), sizeof(Serialized_Node_Type), chunk.size(), fp) != chunk.size()) return false;
+        chunk.clear();
+    }
+    return Save_Tree(root->left_son_ptr, fp, chunk, node_num) && Save_Tree(root->right_son_ptr, fp, chunk, node_num);
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::load(const string & path){
+    FILE * fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr) return false;
+    Tree_File_Header_Type header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, "IKDT", 4) != 0 || header.version != Tree_File_Version
+        || header.point_size != sizeof(PointType) || header.node_size != sizeof(Serialized_Node_Type)){
+        fclose(fp);
+        return false;
+    }
+    // The file is read into a detached tree first, a truncated or corrupt file leaves the current tree untouched
+    struct stat file_stat;
+    if (fstat(fileno(fp), &file_stat) != 0 || header.node_num < 0 || header.buffer_num < 0
+        || file_stat.st_size != int64_t(sizeof(header)) + header.node_num * int64_t(sizeof(Serialized_Node_Type)) + header.buffer_num * int64_t(sizeof(PointType))){
+        fclose(fp);
+        return false;
+    }
+    if (STATIC_ROOT_NODE == nullptr){
+        STATIC_ROOT_NODE = new KD_TREE_NODE;
+        InitTreeNode(STATIC_ROOT_NODE);
+    }
+    KD_TREE_NODE * new_root = nullptr;
+    vector<KD_TREE_NODE *> load_pool;
+    Tree_File_Reader_Type reader;
+    reader.fp = fp;
+    reader.chunk.resize(Tree_File_Chunk_Size);
+    reader.chunk_pos = Tree_File_Chunk_Size;
+    reader.remaining_num = header.node_num;
+    bool success = header.node_num == 0 || Load_Tree(&new_root, STATIC_ROOT_NODE, reader, load_pool);
+    success = success && reader.remaining_num == 0 && reader.chunk_pos == reader.chunk.size();
+    PointVector buffer_points(header.buffer_num);
+    if (success && header.buffer_num > 0) success = fread(buffer_points.data(), sizeof(PointType), header.buffer_num, fp) == header.buffer_num;
+    fclose(fp);
+    if (!success){
+        recycle_tree_nodes(&new_root, load_pool);
+        release_node_pool(load_pool, 0);
+        return false;
+    }
+    Discard_Tree();
+    release_node_pool(Node_Pool, Max_Recycled_Node_Num);
+    InitTreeNode(STATIC_ROOT_NODE);
+    STATIC_ROOT_NODE->left_son_ptr = new_root;
+    Root_Node = new_root;
+    if (Root_Node != nullptr){
+        Update(STATIC_ROOT_NODE);
+        STATIC_ROOT_NODE->TreeSize = 0;
+        Update(Root_Node);
+    }
+    Insert_Buffer.swap(buffer_points);
+    for (int k = 0; k < 3; k++) Insert_Buffer_Coord[k].clear();
+    for (int i = 0; i < Insert_Buffer.size(); i++){
+        Insert_Buffer_Coord[0].push_back(Insert_Buffer[i].x);
+        Insert_Buffer_Coord[1].push_back(Insert_Buffer[i].y);
+        Insert_Buffer_Coord[2].push_back(Insert_Buffer[i].z);
+    }
+    if (Voxel_Index_Enabled) set_voxel_index(true);
+    // A trace replays the loaded tree as a Build of its valid points
+    if (Trace_File.load() != nullptr){
+        PointVector points;
+        if (Root_Node != nullptr) flatten(Root_Node, points, NOT_RECORD);
+        points.insert(points.end(), Insert_Buffer.begin(), Insert_Buffer.end());
+        Trace_Append(TRACE_BUILD, points.data(), points.size());
+    }
+    if (Journal_Fd >= 0 && !checkpoint()) printf("Failed to checkpoint the journal %s\n", Journal_Path.c_str());
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Load_Tree(KD_TREE_NODE ** root, KD_TREE_NODE * father, Tree_File_Reader_Type & reader, vector<KD_TREE_NODE *> & node_pool){
+    if (reader.chunk_pos == reader.chunk.size()){
+        size_t read_num = min(int64_t(reader.chunk.size()), reader.remaining_num);
+        if (read_num == 0 || fread(reader.chunk.data(), sizeof(Serialized_Node_Type), read_num, reader.fp) != read_num) return false;
+        reader.chunk.resize(read_num);
+        reader.chunk_pos = 0;
+        reader.remaining_num -= read_num;
+    }
+    const Serialized_Node_Type & node = reader.chunk[reader.chunk_pos++];
+    if (node.division_axis > 2 || node.TreeSize < 1 || node.invalid_point_num < 0 || node.invalid_point_num > node.TreeSize || node.down_del_num < 0 || node.down_del_num > node.TreeSize) return false;
+    *root = new_tree_node(&node_pool);
+    InitTreeNode(*root);
+    (*root)->point = node.point;
+    (*root)->node_range_x[0] = node.node_range[0];
+    (*root)->node_range_x[1] = node.node_range[1];
+    (*root)->node_range_y[0] = node.node_range[2];
+    (*root)->node_range_y[1] = node.node_range[3];
+    (*root)->node_range_z[0] = node.node_range[4];
+    (*root)->node_range_z[1] = node.node_range[5];
+    (*root)->radius_sq = node.radius_sq;
+    (*root)->time_min = node.time_min;
+    (*root)->time_max = node.time_max;
+    (*root)->TreeSize = node.TreeSize;
+    (*root)->invalid_point_num = node.invalid_point_num;
+    (*root)->down_del_num = node.down_del_num;
+    (*root)->division_axis = node.division_axis;
+    (*root)->point_deleted = node.flags & (1 << 0);
+    (*root)->tree_deleted = node.flags & (1 << 1);
+    (*root)->point_downsample_deleted = node.flags & (1 << 2);
+    (*root)->tree_downsample_deleted = node.flags & (1 << 3);
+    (*root)->need_push_down_to_left = node.flags & (1 << 4);
+    (*root)->need_push_down_to_right = node.flags & (1 << 5);
+    (*root)->father_ptr = father;
+    bool has_left = node.flags & (1 << 6), has_right = node.flags & (1 << 7);
+    if (has_left && !Load_Tree(&(*root)->left_son_ptr, *root, reader, node_pool)) return false;
+    if (has_right && !Load_Tree(&(*root)->right_son_ptr, *root, reader, node_pool)) return false;
+    int son_size = ((*root)->left_son_ptr != nullptr ? (*root)->left_son_ptr->TreeSize : 0) + ((*root)->right_son_ptr != nullptr ? (*root)->right_son_ptr->TreeSize : 0);
+    return (*root)->TreeSize == son_size + 1;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::open_journal(const string & path, bool sync, size_t batch_bytes, size_t checkpoint_bytes){
+    close_journal();
+    Journal_Path = path;
+    Journal_Sync = sync;
+    Journal_Batch_Limit = batch_bytes;
+    Journal_Checkpoint_Limit = checkpoint_bytes;
+    int fd = ::open((path + ".journal").c_str(), O_RDWR);
+    if (fd < 0){
+        // Nothing to recover, the journal starts from a checkpoint of the current tree
+        Journal_Generation = 0;
+        if (checkpoint()) return true;
+        Journal_Path.clear();
+        return false;
+    }
+    // Restore the last checkpoint, then replay the complete records written after it
+    Journal_File_Header_Type header;
+    off_t valid_size = sizeof(header);
+    bool success = pread(fd, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, "IKDJ", 4) == 0
+                && header.version == Journal_File_Version && header.point_size == sizeof(PointType);
+    success = success && load(checkpoint_path(header.generation));
+    if (success){
+        Journal_Generation = header.generation;
+        Journal_Replaying = true;
+        Journal_Replay(fd, valid_size);
+        Journal_Replaying = false;
+        // A torn record at the tail is dropped so that new records follow the last complete one
+        success = ftruncate(fd, valid_size) == 0 && lseek(fd, 0, SEEK_END) == valid_size;
+    }
+    if (!success){
+        ::close(fd);
+        Journal_Path.clear();
+        return false;
+    }
+    // Checkpoints left behind by an interrupted checkpoint()
+    unlink(checkpoint_path(Journal_Generation - 1).c_str());
+    unlink(checkpoint_path(Journal_Generation + 1).c_str());
+    Journal_Fd = fd;
+    Journal_Size = valid_size - sizeof(header);
+    Journal_Checkpoint_Due = Journal_Checkpoint_Limit > 0 && Journal_Size >= Journal_Checkpoint_Limit;
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::flush_journal(){
+    if (Journal_Fd < 0) return Journal_Buffer.empty();
+    size_t written = 0;
+    while (written < Journal_Buffer.size()){
+        ssize_t retval = write(Journal_Fd, Journal_Buffer.data() + written, Journal_Buffer.size() - written);
+        if (retval < 0 && errno == EINTR) continue;
+        if (retval < 0){
+            // Keep only the records not written yet, the next flush appends them after the written prefix
+            Journal_Buffer.erase(Journal_Buffer.begin(), Journal_Buffer.begin() + written);
+            return false;
+        }
+        written += retval;
+    }
+    Journal_Buffer.clear();
+    return !Journal_Sync || fdatasync(Journal_Fd) == 0;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::checkpoint(){
+    if (Journal_Path.empty() || !flush_journal()) return false;
+    // The new journal is the commit point: until it replaces the old one, recovery uses the previous checkpoint
+    int64_t generation = Journal_Generation + 1;
+    string path = checkpoint_path(generation);
+    if (!save(path + ".tmp") || (Journal_Sync && !sync_path(path + ".tmp")) || rename((path + ".tmp").c_str(), path.c_str()) != 0) return false;
+    if (!Journal_Create(generation)) return false;
+    unlink(checkpoint_path(Journal_Generation).c_str());
+    Journal_Generation = generation;
+    Journal_Size = 0;
+    Journal_Checkpoint_Due = false;
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::close_journal(){
+    if (Journal_Fd >= 0){
+        if (!flush_journal()) printf("Failed to flush the journal %s\n", Journal_Path.c_str());
+        ::close(Journal_Fd);
+    }
+    Journal_Fd = -1;
+    Journal_Path.clear();
+    Journal_Buffer.clear();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Journal_Append(operation_set op, const void * payload, uint32_t num, bool downsample_on, double time){
+    if (Journal_Fd < 0 || Journal_Replaying) return;
+    if (Journal_Checkpoint_Due && !checkpoint()) printf("Failed to checkpoint the journal %s\n", Journal_Path.c_str());
+    size_t payload_size = num * ((op == ADD_POINT || op == DELETE_POINT) ? sizeof(PointType) : sizeof(BoxPointType));
+    Journal_Record_Type record;
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.num = num;
+    record.time = time;
+    record.downsample_on = downsample_on;
+    record.checksum = journal_checksum((const char *) payload, payload_size, journal_checksum((const char *) &record, sizeof(record), 2166136261u));
+    Journal_Buffer.insert(Journal_Buffer.end(), (const char *) &record, (const char *) &record + sizeof(record));
+    Journal_Buffer.insert(Journal_Buffer.end(), (const char *) payload, (const char *) payload + payload_size);
+    Journal_Size += sizeof(record) + payload_size;
+    if (Journal_Buffer.size() >= Journal_Batch_Limit && !flush_journal()) printf("Failed to flush the journal %s\n", Journal_Path.c_str());
+    // Checkpoint before the next operation, once the current one has been applied
+    if (Journal_Checkpoint_Limit > 0 && Journal_Size >= Journal_Checkpoint_Limit) Journal_Checkpoint_Due = true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Journal_Replay(int fd, off_t & valid_size){
+    FILE * fp = fdopen(dup(fd), "rb");
+    if (fp == nullptr || fseek(fp, valid_size, SEEK_SET) != 0){
+        if (fp != nullptr) fclose(fp);
+        return false;
+    }
+    Journal_Record_Type record;
+    PointVector points;
+    vector<BoxPointType> boxes;
+    while (fread(&record, sizeof(record), 1, fp) == 1){
+        bool point_op = record.op == ADD_POINT || record.op == DELETE_POINT;
+        bool box_op = record.op == ADD_BOX || record.op == DELETE_BOX || record.op == DELETE_OUTSIDE_BOX;
+        if (!point_op && !box_op && record.op != DELETE_OLDER_THAN) break;
+        char * payload = nullptr;
+        size_t payload_size = 0;
+        if (point_op){
+            points.resize(record.num);
+            payload = (char *) points.data();
+            payload_size = record.num * sizeof(PointType);
+        } else if (box_op){
+            boxes.resize(record.num);
+            payload = (char *) boxes.data();
+            payload_size = record.num * sizeof(BoxPointType);
+        }
+        if (payload_size > 0 && fread(payload, 1, payload_size, fp) != payload_size) break;
+        uint32_t checksum = record.checksum;
+        record.checksum = 0;
+        if (journal_checksum(payload, payload_size, journal_checksum((const char *) &record, sizeof(record), 2166136261u)) != checksum) break;
+        switch (record.op)
+        {
+        case ADD_POINT:
+            Add_Points(points, record.downsample_on);
+            break;
+        case DELETE_POINT:
+            Delete_Points(points);
+            break;
+        case ADD_BOX:
+            Add_Point_Boxes(boxes);
+            break;
+        case DELETE_BOX:
+            Delete_Point_Boxes(boxes);
+            break;
+        case DELETE_OUTSIDE_BOX:
+            if (!boxes.empty()) Delete_Outside_Box(boxes[0]);
+            break;
+        case DELETE_OLDER_THAN:
+            Delete_Older_Than(record.time);
+            break;
+        default:
+            break;
+        }
+        valid_size += sizeof(record) + payload_size;
+    }
+    fclose(fp);
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Journal_Create(int64_t generation){
+    string path = Journal_Path + ".journal";
+    int fd = ::open((path + ".tmp").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    Journal_File_Header_Type header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IKDJ", 4);
+    header.version = Journal_File_Version;
+    header.point_size = sizeof(PointType);
+    header.generation = generation;
+    bool success = write(fd, &header, sizeof(header)) == sizeof(header) && (!Journal_Sync || fdatasync(fd) == 0);
+    success = success && rename((path + ".tmp").c_str(), path.c_str()) == 0;
+    // Make the renames durable before the previous checkpoint is removed
+    size_t slash = path.find_last_of('/');
+    if (success && Journal_Sync) success = sync_path(slash == string::npos ? "." : path.substr(0, slash + 1));
+    if (!success){
+        ::close(fd);
+        return false;
+    }
+    if (Journal_Fd >= 0) ::close(Journal_Fd);
+    Journal_Fd = fd;
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+string KD_TREE<PointType, ThreadPolicy>::checkpoint_path(int64_t generation){
+    return Journal_Path + ".checkpoint." + to_string(generation);
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::sync_path(const string & path){
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool success = fsync(fd) == 0;
+    ::close(fd);
+    return success;
+}
+
+template <typename PointType, typename ThreadPolicy>
+uint32_t KD_TREE<PointType, ThreadPolicy>::journal_checksum(const char * data, size_t size, uint32_t hash){
+    // FNV-1a, enough to tell a torn record from a complete one
+    for (size_t i = 0; i < size; i++){
+        hash ^= uint8_t(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::start_trace(const string & path){
+    stop_trace();
+    FILE * fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) return false;
+    Trace_File_Header_Type header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IKDR", 4);
+    header.version = Trace_File_Version;
+    header.point_size = sizeof(PointType);
+    header.config = Trace_Config();
+    if (fwrite(&header, sizeof(header), 1, fp) != 1){
+        fclose(fp);
+        return false;
+    }
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&trace_mutex_lock);
+    Trace_File = fp;
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&trace_mutex_lock);
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::stop_trace(){
+    if (Trace_File.load() == nullptr) return;
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&trace_mutex_lock);
+    FILE * fp = Trace_File.exchange(nullptr);
+    if (fp != nullptr && fclose(fp) != 0) printf("Failed to write the trace\n");
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&trace_mutex_lock);
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::replay_trace(const string & path, function<void(trace_op_set, double)> latency_callback){
+    FILE * fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr) return false;
+    Trace_File_Header_Type header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, "IKDR", 4) != 0 || header.version != Trace_File_Version || header.point_size != sizeof(PointType)){
+        fclose(fp);
+        return false;
+    }
+    Trace_Record_Type record;
+    Trace_Config_Type config;
+    PointVector points, result_points;
+    vector<BoxPointType> boxes;
+    vector<float> result_dist;
+    Trace_Replaying = true;
+    // The rebuild mode is fixed at construction, the rest of the configuration is taken over from the recording tree
+    bool success = Apply_Trace_Config(header.config);
+    while (success && fread(&record, sizeof(record), 1, fp) == 1){
+        if (record.op >= TRACE_OP_NUM){
+            success = false;
+            break;
+        }
+        if (record.op == TRACE_CONFIGURE){
+            success = record.num == 1 && fread(&config, sizeof(config), 1, fp) == 1;
+        } else if (Trace_Payload_Size(record.op) == sizeof(BoxPointType)){
+            boxes.resize(record.num);
+            success = fread(boxes.data(), sizeof(BoxPointType), record.num, fp) == record.num;
+        } else {
+            points.resize(record.num);
+            success = fread(points.data(), sizeof(PointType), record.num, fp) == record.num;
+        }
+        bool single_op = record.op == TRACE_NEAREST_SEARCH || record.op == TRACE_BOX_SEARCH || record.op == TRACE_RADIUS_SEARCH || record.op == TRACE_DELETE_OUTSIDE_BOX;
+        bool empty_op = record.op == TRACE_DELETE_OLDER_THAN || record.op == TRACE_RUN_PENDING_REBUILDS || record.op == TRACE_FLUSH_INSERT_BUFFER;
+        if (!success || (single_op && record.num != 1) || (empty_op && record.num != 0)){
+            success = false;
+            break;
+        }
+        if (record.op == TRACE_DELETE_OLDER_THAN && !Point_Timestamp){
+            printf("The trace deletes points by time, set_point_timestamp must be called before replay_trace\n");
+            success = false;
+            break;
+        }
+        auto call_start = chrono::high_resolution_clock::now();
+        switch (record.op)
+        {
+        case TRACE_BUILD:
+            Build(points);
+            break;
+        case TRACE_ADD_POINTS:
+            Add_Points(points, record.downsample_on, record.param[0]);
+            break;
+        case TRACE_DELETE_POINTS:
+            Delete_Points(points, record.param[0]);
+            break;
+        case TRACE_DELETE_BOXES:
+            Delete_Point_Boxes(boxes);
+            break;
+        case TRACE_ADD_BOXES:
+            Add_Point_Boxes(boxes);
+            break;
+        case TRACE_NEAREST_SEARCH:
+            Nearest_Search(points[0], record.k_nearest, result_points, result_dist, record.param[0], record.param[1], record.param[2]);
+            break;
+        case TRACE_BOX_SEARCH:
+            Box_Search(boxes[0], result_points);
+            break;
+        case TRACE_RADIUS_SEARCH:
+            Radius_Search(points[0], record.param[0], result_points);
+            break;
+        case TRACE_DELETE_OUTSIDE_BOX:
+            Delete_Outside_Box(boxes[0]);
+            break;
+        case TRACE_DELETE_OLDER_THAN:
+            Delete_Older_Than(record.param[0]);
+            break;
+        case TRACE_RUN_PENDING_REBUILDS:
+            run_pending_rebuilds(record.param[0]);
+            break;
+        case TRACE_FLUSH_INSERT_BUFFER:
+            flush_insert_buffer();
+            break;
+        case TRACE_CONFIGURE:
+            success = Apply_Trace_Config(config);
+            break;
+        default:
+            break;
+        }
+        auto call_end = chrono::high_resolution_clock::now();
+        if (latency_callback) latency_callback(trace_op_set(record.op), chrono::duration_cast<chrono::nanoseconds>(call_end - call_start).count() / 1e3);
+    }
+    Trace_Replaying = false;
+    fclose(fp);
+    return success;
+}
+
+template <typename PointType, typename ThreadPolicy>
+typename KD_TREE<PointType, ThreadPolicy>::Trace_Config_Type KD_TREE<PointType, ThreadPolicy>::Trace_Config(){
+    Trace_Config_Type config;
+    memset(&config, 0, sizeof(config));
+    config.rebuild_mode = Rebuild_Policy.mode;
+    config.delete_param = delete_criterion_param;
+    config.balance_param = balance_criterion_param;
+    config.downsample_size = downsample_size;
+    config.minimal_unbalanced_tree_size = minimal_unbalanced_tree_size;
+    config.multi_thread_rebuild_point_num = multi_thread_rebuild_point_num;
+    config.adaptive_rebuild = Adaptive_Rebuild;
+    config.split_strategy = Split_Strategy;
+    config.voxel_index = Voxel_Index_Enabled;
+    config.insert_buffer_size = Insert_Buffer_Size;
+    config.max_point_num = Max_Point_Num;
+    config.eviction_policy = Eviction_Policy;
+    config.eviction_center[0] = Eviction_Center.x;
+    config.eviction_center[1] = Eviction_Center.y;
+    config.eviction_center[2] = Eviction_Center.z;
+    return config;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Apply_Trace_Config(const Trace_Config_Type & config){
+    if (config.split_strategy > SPLIT_SURFACE_AREA || config.eviction_policy > EVICT_LEAST_QUERIED) return false;
+    if (config.max_point_num > 0 && config.eviction_policy == EVICT_OLDEST && !Point_Timestamp){
+        printf("The traced tree evicts its oldest points, set_point_timestamp must be called before replay_trace\n");
+        return false;
+    }
+    // Setters with side effects beyond the parameter are only called on a change
+    Set_delete_criterion_param(config.delete_param);
+    Set_balance_criterion_param(config.balance_param);
+    Set_minimal_unbalanced_tree_size(config.minimal_unbalanced_tree_size);
+    Set_multi_thread_rebuild_point_num(config.multi_thread_rebuild_point_num);
+    if (bool(config.adaptive_rebuild) != Adaptive_Rebuild) set_adaptive_rebuild(config.adaptive_rebuild);
+    set_split_strategy(split_strategy_set(config.split_strategy));
+    if (config.downsample_size != downsample_size) set_downsample_param(config.downsample_size);
+    if (bool(config.voxel_index) != Voxel_Index_Enabled) set_voxel_index(config.voxel_index);
+    set_insert_buffer(config.insert_buffer_size);
+    if (config.max_point_num != Max_Point_Num || config.eviction_policy != Eviction_Policy) set_capacity(config.max_point_num, eviction_policy_set(config.eviction_policy));
+    PointType center = Eviction_Center;
+    center.x = config.eviction_center[0];
+    center.y = config.eviction_center[1];
+    center.z = config.eviction_center[2];
+    set_eviction_center(center);
+    return true;
+}
+
+template <typename PointType, typename ThreadPolicy>
+size_t KD_TREE<PointType, ThreadPolicy>::Trace_Payload_Size(uint32_t op){
+    if (op == TRACE_DELETE_BOXES || op == TRACE_ADD_BOXES || op == TRACE_BOX_SEARCH || op == TRACE_DELETE_OUTSIDE_BOX) return sizeof(BoxPointType);
+    if (op == TRACE_CONFIGURE) return sizeof(Trace_Config_Type);
+    return sizeof(PointType);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Trace_Configure(){
+    if (Trace_File.load(memory_order_relaxed) == nullptr || Trace_Replaying) return;
+    Trace_Config_Type config = Trace_Config();
+    Trace_Append(TRACE_CONFIGURE, &config, 1);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Trace_Append(trace_op_set op, const void * payload, uint32_t num, int k_nearest, bool downsample_on, double param_0, double param_1, double param_2){
+    if (Trace_File.load(memory_order_relaxed) == nullptr || Trace_Replaying) return;
+    Trace_Record_Type record;
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.num = num;
+    record.k_nearest = k_nearest;
+    record.downsample_on = downsample_on;
+    record.param[0] = param_0;
+    record.param[1] = param_1;
+    record.param[2] = param_2;
+    // Searches may come from other threads than the updates, the file is only used under the lock
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&trace_mutex_lock);
+    FILE * fp = Trace_File.load();
+    if (fp != nullptr){
+        fwrite(&record, sizeof(record), 1, fp);
+        if (num > 0) fwrite(payload, Trace_Payload_Size(op), num, fp);
+    }
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&trace_mutex_lock);
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::save_static(const string & path){
+    PointVector points;
+    if (ThreadPolicy::Multi_Thread){
+        pthread_mutex_lock(&search_flag_mutex);
+        while (search_mutex_counter == -1){
+            pthread_mutex_unlock(&search_flag_mutex);
+            usleep(1);
+            pthread_mutex_lock(&search_flag_mutex);
+        }
+        search_mutex_counter += 1;
+        pthread_mutex_unlock(&search_flag_mutex);
+    }
+    flatten(Root_Node, points, NOT_RECORD);
+    if (ThreadPolicy::Multi_Thread){
+        pthread_mutex_lock(&search_flag_mutex);
+        search_mutex_counter -= 1;
+        pthread_mutex_unlock(&search_flag_mutex);
+    }
+    points.insert(points.end(), Insert_Buffer.begin(), Insert_Buffer.end());
+    // Only valid points are written, partitioned afresh so the static tree carries no deleted nodes
+    vector<Static_Tree_Node_Type<PointType>> nodes;
+    if (!points.empty()){
+        vector<Build_Split_Type> splits;
+        Partition_Points(0, points.size()-1, points, splits);
+        nodes.reserve(points.size());
+        int split_counter = 0;
+        Build_Static_Nodes(0, points.size()-1, points, splits, split_counter, nodes);
+    }
+    FILE * fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) return false;
+    Static_Tree_Header_Type header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IKDS", 4);
+    header.version = Static_Tree_File_Version;
+    header.point_size = sizeof(PointType);
+    header.node_size = sizeof(Static_Tree_Node_Type<PointType>);
+    header.node_num = nodes.size();
+    bool success = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (success && !nodes.empty()) success = fwrite(nodes.data(), sizeof(Static_Tree_Node_Type<PointType>), nodes.size(), fp) == nodes.size();
+    success = fclose(fp) == 0 && success;
+    return success;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Build_Static_Nodes(int l, int r, const PointVector & Storage, const vector<Build_Split_Type> & splits, int & split_counter, vector<Static_Tree_Node_Type<PointType>> & nodes){
+    int index = nodes.size();
+    const Build_Split_Type & split = splits[split_counter++];
+    Static_Tree_Node_Type<PointType> node;
+    memset(static_cast<void *>(&node), 0, sizeof(node));
+    node.point = Storage[split.mid];
+    node.tree_size = r - l + 1;
+    node.left_size = split.mid - l;
+    node.division_axis = split.axis;
+    node.node_range[0] = node.node_range[1] = node.point.x;
+    node.node_range[2] = node.node_range[3] = node.point.y;
+    node.node_range[4] = node.node_range[5] = node.point.z;
+    nodes.push_back(node);
+    int son_index[2] = {-1, -1};
+    if (split.mid > l) son_index[0] = Build_Static_Nodes(l, split.mid-1, Storage, splits, split_counter, nodes);
+    if (split.mid < r) son_index[1] = Build_Static_Nodes(split.mid+1, r, Storage, splits, split_counter, nodes);
+    for (int i = 0; i < 2; i++){
+        if (son_index[i] < 0) continue;
+        for (int k = 0; k < 3; k++){
+            nodes[index].node_range[2*k] = min(nodes[index].node_range[2*k], nodes[son_index[i]].node_range[2*k]);
+            nodes[index].node_range[2*k+1] = max(nodes[index].node_range[2*k+1], nodes[son_index[i]].node_range[2*k+1]);
+        }
+    }
+    return index;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Nearest_Search(PointType point, int k_nearest, PointVector& Nearest_Points, vector<float> & Point_Distance, double max_dist){   
+    Nearest_Search(point, k_nearest, Nearest_Points, Point_Distance, max_dist, -INFINITY, INFINITY);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Nearest_Search(PointType point, int k_nearest, PointVector& Nearest_Points, vector<float> & Point_Distance, double max_dist, double time_min, double time_max){   
+    LATENCY_SCOPE(LATENCY_KNN);
+    // Only the cost model needs the search time, the clock is not read otherwise
+    bool adaptive_rebuild = Adaptive_Rebuild;
+    chrono::high_resolution_clock::time_point search_start;
+    if (adaptive_rebuild) search_start = chrono::high_resolution_clock::now();
+    Trace_Append(TRACE_NEAREST_SEARCH, &point, 1, k_nearest, false, max_dist, time_min, time_max);
     MANUAL_HEAP q(2*k_nearest);
     q.clear();
     vector<float> ().swap(Point_Distance);
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
-        Search(Root_Node, k_nearest, point, q, max_dist);
+    Time_Window_Type time_window{time_min, time_max};
+    const Time_Window_Type * window = nullptr;
+    if (time_min > -INFINITY || time_max < INFINITY){
+        if (!Point_Timestamp) throw "Error: Windowed search requires set_point_timestamp\n";
+        window = &time_window;
+    }
+    if (!Insert_Buffer.empty()) Buffer_Search(k_nearest, point, q, max_dist, window);
+    if (!in_background_rebuild(Root_Node)){
+        Search(Root_Node, k_nearest, point, q, max_dist, Lazy_Tag_Type(), window);
     } else {
         pthread_mutex_lock(&search_flag_mutex);
         while (search_mutex_counter == -1)
@@ -380,11 +1595,15 @@ void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVec
         }
         search_mutex_counter += 1;
         pthread_mutex_unlock(&search_flag_mutex);  
-        Search(Root_Node, k_nearest, point, q, max_dist);  
+        Search(Root_Node, k_nearest, point, q, max_dist, Lazy_Tag_Type(), window);  
         pthread_mutex_lock(&search_flag_mutex);
         search_mutex_counter -= 1;
         pthread_mutex_unlock(&search_flag_mutex);      
     }
+    if (Search_Visit_Stats_Enabled){
+        Search_Num.fetch_add(1, memory_order_relaxed);
+        Search_Visit_Num.fetch_add(q.visit_num, memory_order_relaxed);
+    }
     int k_found = min(k_nearest,int(q.size()));
     PointVector ().swap(Nearest_Points);
     vector<float> ().swap(Point_Distance);
@@ -393,47 +1612,100 @@ void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVec
         Point_Distance.insert(Point_Distance.begin(), q.top().dist);
         q.pop();
     }
+    if (Max_Point_Num > 0 && Eviction_Policy == EVICT_LEAST_QUERIED){
+        // Stamp the cells of the query and of the neighbors it returned, the clock advances once per query
+        int stamp = Query_Clock.fetch_add(1, memory_order_relaxed) + 1;
+        query_stamp(point).store(stamp, memory_order_relaxed);
+        for (int i = 0; i < k_found; i++) query_stamp(Nearest_Points[i]).store(stamp, memory_order_relaxed);
+    }
+    if (adaptive_rebuild && Root_Node != nullptr){
+        Query_Time_Total += chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - search_start).count();
+        Query_Level_Total += max(1, int(log2(Root_Node->TreeSize + 1)));
+        Query_Num ++;
+    }
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
 {
+    LATENCY_SCOPE(LATENCY_RANGE_SEARCH);
+    Trace_Append(TRACE_BOX_SEARCH, &Box_of_Point, 1);
     Storage.clear();
     Search_by_range(Root_Node, Box_of_Point, Storage);
+    if (!Insert_Buffer.empty()) Buffer_Search_by_range(Box_of_Point, Storage);
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Radius_Search(PointType point, const float radius, PointVector &Storage)
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Radius_Search(PointType point, const float radius, PointVector &Storage)
 {
+    LATENCY_SCOPE(LATENCY_RANGE_SEARCH);
+    Trace_Append(TRACE_RADIUS_SEARCH, &point, 1, 0, false, radius);
     Storage.clear();
     Search_by_radius(Root_Node, point, radius, Storage);
+    if (!Insert_Buffer.empty()) Buffer_Search_by_radius(point, radius, Storage);
 }
 
-template <typename PointType>
-int KD_TREE<PointType>::Add_Points(PointVector & PointToAdd, bool downsample_on){
-    int NewPointSize = PointToAdd.size();
-    int tree_size = size();
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Add_Points(PointVector & PointToAdd, bool downsample_on, double time_budget_ms){
+    LATENCY_SCOPE(LATENCY_INSERT);
+    auto call_start = chrono::high_resolution_clock::now();
+    Trace_Append(TRACE_ADD_POINTS, PointToAdd.data(), PointToAdd.size(), 0, downsample_on, time_budget_ms);
+    Journal_Append(ADD_POINT, PointToAdd.data(), PointToAdd.size(), downsample_on);
+    Begin_Budgeted_Call(time_budget_ms);
     BoxPointType Box_of_Point;
     PointType downsample_result, mid_point;
     bool downsample_switch = downsample_on && DOWNSAMPLE_SWITCH;
     float min_dist, tmp_dist;
     int tmp_counter = 0;
-    for (int i=0; i<PointToAdd.size();i++){
-        if (downsample_switch){
-            Box_of_Point.vertex_min[0] = floor(PointToAdd[i].x/downsample_size)*downsample_size;
-            Box_of_Point.vertex_max[0] = Box_of_Point.vertex_min[0]+downsample_size;
-            Box_of_Point.vertex_min[1] = floor(PointToAdd[i].y/downsample_size)*downsample_size;
-            Box_of_Point.vertex_max[1] = Box_of_Point.vertex_min[1]+downsample_size; 
-            Box_of_Point.vertex_min[2] = floor(PointToAdd[i].z/downsample_size)*downsample_size;
-            Box_of_Point.vertex_max[2] = Box_of_Point.vertex_min[2]+downsample_size;   
+    if (Max_Point_Num > 0 && Eviction_Policy == EVICT_LEAST_QUERIED){
+        // New points count as queried now, a scan must not be evicted before it was ever searched
+        int stamp = Query_Clock.load(memory_order_relaxed);
+        for (int i = 0; i < PointToAdd.size(); i++) query_stamp(PointToAdd[i]).store(stamp, memory_order_relaxed);
+    }
+    if (Adaptive_Rebuild) Update_Num += PointToAdd.size();
+    if (downsample_switch && !Insert_Buffer.empty()) Merge_Insert_Buffer();
+    if (downsample_switch){
+        // Bucket the new points by voxel so that each occupied voxel is searched and replaced only once
+        Downsample_Voxels.clear();
+        for (int i = 0; i < PointToAdd.size(); i++){
+            Voxel_Point_Type voxel_point;
+            voxel_point.voxel[0] = int64_t(floor(PointToAdd[i].x/downsample_size));
+            voxel_point.voxel[1] = int64_t(floor(PointToAdd[i].y/downsample_size));
+            voxel_point.voxel[2] = int64_t(floor(PointToAdd[i].z/downsample_size));
+            voxel_point.index = i;
+            Downsample_Voxels.push_back(voxel_point);
+        }
+        sort(Downsample_Voxels.begin(), Downsample_Voxels.end());
+        int voxel_end;
+        for (int voxel_begin = 0; voxel_begin < Downsample_Voxels.size(); voxel_begin = voxel_end){
+            voxel_end = voxel_begin + 1;
+            while (voxel_end < Downsample_Voxels.size() && Downsample_Voxels[voxel_end].same_voxel(Downsample_Voxels[voxel_begin])) voxel_end++;
+            for (int k = 0; k < 3; k++){
+                Box_of_Point.vertex_min[k] = Downsample_Voxels[voxel_begin].voxel[k] * downsample_size;
+                Box_of_Point.vertex_max[k] = Box_of_Point.vertex_min[k] + downsample_size;
+            }
             mid_point.x = Box_of_Point.vertex_min[0] + (Box_of_Point.vertex_max[0]-Box_of_Point.vertex_min[0])/2.0;
             mid_point.y = Box_of_Point.vertex_min[1] + (Box_of_Point.vertex_max[1]-Box_of_Point.vertex_min[1])/2.0;
             mid_point.z = Box_of_Point.vertex_min[2] + (Box_of_Point.vertex_max[2]-Box_of_Point.vertex_min[2])/2.0;
-            PointVector ().swap(Downsample_Storage);
-            Search_by_range(Root_Node, Box_of_Point, Downsample_Storage);
-            min_dist = calc_dist(PointToAdd[i],mid_point);
-            downsample_result = PointToAdd[i];                
+            // Representative of the new points in this voxel
+            PointType new_point = PointToAdd[Downsample_Voxels[voxel_begin].index];
+            min_dist = calc_dist(new_point, mid_point);
+            for (int j = voxel_begin + 1; j < voxel_end; j++){
+                tmp_dist = calc_dist(PointToAdd[Downsample_Voxels[j].index], mid_point);
+                if (tmp_dist < min_dist){
+                    min_dist = tmp_dist;
+                    new_point = PointToAdd[Downsample_Voxels[j].index];
+                }
+            }
+            Downsample_Storage.clear();
+            if (Voxel_Index_Enabled){
+                typename Voxel_Map_Type::iterator iter = Voxel_Index.find(voxel_key(new_point));
+                if (iter != Voxel_Index.end()) Downsample_Storage = iter->second;
+            } else {
+                Search_by_range(Root_Node, Box_of_Point, Downsample_Storage);
+            }
+            downsample_result = new_point;                
             for (int index = 0; index < Downsample_Storage.size(); index++){
                 tmp_dist = calc_dist(Downsample_Storage[index], mid_point);
                 if (tmp_dist < min_dist){
@@ -441,14 +1713,19 @@ int KD_TREE<PointType>::Add_Points(PointVector & PointToAdd, bool downsample_on)
                     downsample_result = Downsample_Storage[index];
                 }
             }
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){  
-                if (Downsample_Storage.size() > 1 || same_point(PointToAdd[i], downsample_result)){
+            if (Voxel_Index_Enabled && (Downsample_Storage.size() > 1 || same_point(new_point, downsample_result))){
+                PointVector & voxel_points = Voxel_Index[voxel_key(new_point)];
+                voxel_points.clear();
+                voxel_points.push_back(downsample_result);
+            }
+            if (!in_background_rebuild(Root_Node)){  
+                if (Downsample_Storage.size() > 1 || same_point(new_point, downsample_result)){
                     if (Downsample_Storage.size() > 0) Delete_by_range(&Root_Node, Box_of_Point, true, true);
                     Add_by_point(&Root_Node, downsample_result, true, Root_Node->division_axis);
                     tmp_counter ++;                      
                 }
             } else {
-                if (Downsample_Storage.size() > 1 || same_point(PointToAdd[i], downsample_result)){
+                if (Downsample_Storage.size() > 1 || same_point(new_point, downsample_result)){
                     Operation_Logger_Type  operation_delete, operation;
                     operation_delete.boxpoint = Box_of_Point;
                     operation_delete.op = DOWNSAMPLE_DELETE;
@@ -467,31 +1744,48 @@ int KD_TREE<PointType>::Add_Points(PointVector & PointToAdd, bool downsample_on)
                     pthread_mutex_unlock(&working_flag_mutex);
                 };
             }
+        }
+        Enforce_Capacity();
+        End_Budgeted_Call(call_start, time_budget_ms);
+        return tmp_counter;
+    }
+    for (int i=0; i<PointToAdd.size();i++){
+        if (Voxel_Index_Enabled) Voxel_Index_Insert(PointToAdd[i]);
+        if (Insert_Buffer_Size > 0){
+            Insert_Buffer.push_back(PointToAdd[i]);
+            Insert_Buffer_Coord[0].push_back(PointToAdd[i].x);
+            Insert_Buffer_Coord[1].push_back(PointToAdd[i].y);
+            Insert_Buffer_Coord[2].push_back(PointToAdd[i].z);
+            if (Insert_Buffer.size() >= Insert_Buffer_Size) Merge_Insert_Buffer();
+            continue;
+        }
+        if (!in_background_rebuild(Root_Node)){
+            Add_by_point(&Root_Node, PointToAdd[i], true, Root_Node->division_axis);     
         } else {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
-                Add_by_point(&Root_Node, PointToAdd[i], true, Root_Node->division_axis);     
-            } else {
-                Operation_Logger_Type operation;
-                operation.point = PointToAdd[i];
-                operation.op = ADD_POINT;                
-                pthread_mutex_lock(&working_flag_mutex);
-                Add_by_point(&Root_Node, PointToAdd[i], false, Root_Node->division_axis);
-                if (rebuild_flag){
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                    Rebuild_Logger.push(operation);
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-                }
-                pthread_mutex_unlock(&working_flag_mutex);       
+            Operation_Logger_Type operation;
+            operation.point = PointToAdd[i];
+            operation.op = ADD_POINT;                
+            pthread_mutex_lock(&working_flag_mutex);
+            Add_by_point(&Root_Node, PointToAdd[i], false, Root_Node->division_axis);
+            if (rebuild_flag){
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
+            pthread_mutex_unlock(&working_flag_mutex);       
         }
     }
+    Enforce_Capacity();
+    End_Budgeted_Call(call_start, time_budget_ms);
     return tmp_counter;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Add_Point_Boxes(vector<BoxPointType> & BoxPoints){     
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Add_Point_Boxes(vector<BoxPointType> & BoxPoints){     
+    Trace_Append(TRACE_ADD_BOXES, BoxPoints.data(), BoxPoints.size());
+    Journal_Append(ADD_BOX, BoxPoints.data(), BoxPoints.size());
     for (int i=0;i < BoxPoints.size();i++){
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
+        if (!in_background_rebuild(Root_Node)){
             Add_by_range(&Root_Node ,BoxPoints[i], true);
         } else {
             Operation_Logger_Type operation;
@@ -506,75 +1800,620 @@ void KD_TREE<PointType>::Add_Point_Boxes(vector<BoxPointType> & BoxPoints){
             }               
             pthread_mutex_unlock(&working_flag_mutex);
         }    
+        if (Voxel_Index_Enabled){
+            // Boxes can revive points the index no longer knows about, reload them from the tree
+            PointVector revived_points;
+            Voxel_Index_Delete_Box(BoxPoints[i]);
+            Search_by_range(Root_Node, BoxPoints[i], revived_points);
+            if (!Insert_Buffer.empty()) Buffer_Search_by_range(BoxPoints[i], revived_points);
+            for (int j = 0; j < revived_points.size(); j++) Voxel_Index_Insert(revived_points[j]);
+        }
     } 
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Delete_Points(PointVector & PointToDel){        
-    for (int i=0;i<PointToDel.size();i++){
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){               
-            Delete_by_point(&Root_Node, PointToDel[i], true);
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Delete_Points(PointVector & PointToDel, double time_budget_ms){        
+    LATENCY_SCOPE(LATENCY_DELETE);
+    auto call_start = chrono::high_resolution_clock::now();
+    int tmp_counter = 0;
+    Trace_Append(TRACE_DELETE_POINTS, PointToDel.data(), PointToDel.size(), 0, false, time_budget_ms);
+    Journal_Append(DELETE_POINT, PointToDel.data(), PointToDel.size());
+    Begin_Budgeted_Call(time_budget_ms);
+    if (Adaptive_Rebuild) Update_Num += PointToDel.size();
+    Delete_Storage.clear();
+    for (int i=0;i<PointToDel.size();i++){
+        if (Voxel_Index_Enabled) Voxel_Index_Delete(PointToDel[i]);
+        if (!Insert_Buffer.empty() && Buffer_Delete(PointToDel[i])){
+            tmp_counter ++;
+            continue;
+        }
+        Delete_Storage.push_back(PointToDel[i]);
+    }
+    if (Delete_Storage.empty() || Root_Node == nullptr){
+        End_Budgeted_Call(call_start, time_budget_ms);
+        return tmp_counter;
+    }
+    // Delete all remaining points in a single sweep down the tree
+    if (!in_background_rebuild(Root_Node)){               
+        tmp_counter += Delete_by_batch(&Root_Node, Delete_Storage, 0, Delete_Storage.size()-1, true);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);        
+        tmp_counter += Delete_by_batch(&Root_Node, Delete_Storage, 0, Delete_Storage.size()-1, false);
+        if (rebuild_flag) Log_Batch_Points(Delete_Storage, 0, Delete_Storage.size()-1, DELETE_POINT);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }      
+    End_Budgeted_Call(call_start, time_budget_ms);
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::run_pending_rebuilds(double time_budget_ms){
+    Trace_Append(TRACE_RUN_PENDING_REBUILDS, nullptr, 0, 0, false, time_budget_ms);
+    if (Root_Node == nullptr) return 0;
+    auto deadline = chrono::high_resolution_clock::now() + chrono::nanoseconds((long long)(max(time_budget_ms, 0.0) * 1e6));
+    return Rebuild_pending(&Root_Node, deadline);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Begin_Budgeted_Call(double time_budget_ms){
+    Defer_Rebuild = time_budget_ms >= 0;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::End_Budgeted_Call(chrono::high_resolution_clock::time_point call_start, double time_budget_ms){
+    if (time_budget_ms < 0) return;
+    Defer_Rebuild = false;
+    if (Root_Node == nullptr) return;
+    Rebuild_pending(&Root_Node, call_start + chrono::nanoseconds((long long)(time_budget_ms * 1e6)));
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Rebuild_pending(KD_TREE_NODE ** root, chrono::high_resolution_clock::time_point deadline){
+    if ((*root) == nullptr || !(*root)->tree_rebuild_pending || in_background_rebuild(*root)) return 0;
+    if ((*root)->rebuild_pending){
+        (*root)->rebuild_pending = false;
+        if (Criterion_Check(*root)){
+            long long rebuild_points = Rebuild_Point_Total;
+            double rebuild_cost = rebuild_points > 0 ? double(Rebuild_Time_Total) / rebuild_points : 0.0;
+            if (chrono::high_resolution_clock::now() + chrono::nanoseconds((long long)(rebuild_cost * (*root)->TreeSize)) <= deadline){
+                // The rebuilt subtree consists of fresh nodes and carries no pending marks
+                Rebuild(root);
+                return 1;
+            }
+            (*root)->rebuild_pending = true;
+        }
+    }
+    int rebuild_counter = 0;
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    rebuild_counter += Rebuild_pending(&((*root)->left_son_ptr), deadline);
+    rebuild_counter += Rebuild_pending(&((*root)->right_son_ptr), deadline);
+    Update(*root);
+    (*root)->working_flag = false;
+    return rebuild_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Delete_Point_Boxes(vector<BoxPointType> & BoxPoints){
+    LATENCY_SCOPE(LATENCY_BOX_DELETE);
+    int tmp_counter = 0;
+    Trace_Append(TRACE_DELETE_BOXES, BoxPoints.data(), BoxPoints.size());
+    Journal_Append(DELETE_BOX, BoxPoints.data(), BoxPoints.size());
+    for (int i=0;i < BoxPoints.size();i++){ 
+        if (Voxel_Index_Enabled) Voxel_Index_Delete_Box(BoxPoints[i]);
+        if (!Insert_Buffer.empty()) tmp_counter += Buffer_Delete_by_range(BoxPoints[i]);
+        if (!in_background_rebuild(Root_Node)){               
+            tmp_counter += Delete_by_range(&Root_Node ,BoxPoints[i], true, false);
+        } else {
+            Operation_Logger_Type operation;
+            operation.boxpoint = BoxPoints[i];
+            operation.op = DELETE_BOX;     
+            pthread_mutex_lock(&working_flag_mutex); 
+            tmp_counter += Delete_by_range(&Root_Node ,BoxPoints[i], false, false);
+            if (rebuild_flag){
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }                
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    } 
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Delete_Outside_Box(const BoxPointType & BoxPoint){
+    LATENCY_SCOPE(LATENCY_BOX_DELETE);
+    Trace_Append(TRACE_DELETE_OUTSIDE_BOX, &BoxPoint, 1);
+    return Apply_Delete_Outside_Box(BoxPoint);
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Delete_Older_Than(double time){
+    if (!Point_Timestamp) throw "Error: Delete_Older_Than requires set_point_timestamp\n";
+    Trace_Append(TRACE_DELETE_OLDER_THAN, nullptr, 0, 0, false, time);
+    return Apply_Delete_Older_Than(time);
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Apply_Delete_Outside_Box(const BoxPointType & BoxPoint){
+    int tmp_counter = 0;
+    Journal_Append(DELETE_OUTSIDE_BOX, &BoxPoint, 1);
+    if (!Insert_Buffer.empty()) tmp_counter += Buffer_Delete_outside_range(BoxPoint);
+    Removed_Storage.clear();
+    if (!in_background_rebuild(Root_Node)){
+        tmp_counter += Delete_outside_range(&Root_Node, BoxPoint, true, Voxel_Index_Enabled);
+    } else {
+        Operation_Logger_Type operation;
+        operation.boxpoint = BoxPoint;
+        operation.op = DELETE_OUTSIDE_BOX;
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_outside_range(&Root_Node, BoxPoint, false, Voxel_Index_Enabled);
+        if (rebuild_flag){
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(operation);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    for (int i = 0; i < Removed_Storage.size(); i++) Voxel_Index_Delete(Removed_Storage[i]);
+    Removed_Storage.clear();
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Apply_Delete_Older_Than(double time){
+    int tmp_counter = 0;
+    Journal_Append(DELETE_OLDER_THAN, nullptr, 0, false, time);
+    if (!Insert_Buffer.empty()) tmp_counter += Buffer_Delete_older_than(time);
+    Removed_Storage.clear();
+    if (!in_background_rebuild(Root_Node)){
+        tmp_counter += Delete_older_than(&Root_Node, time, true, Voxel_Index_Enabled);
+    } else {
+        Operation_Logger_Type operation;
+        operation.timestamp = time;
+        operation.op = DELETE_OLDER_THAN;
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_older_than(&Root_Node, time, false, Voxel_Index_Enabled);
+        if (rebuild_flag){
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(operation);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    for (int i = 0; i < Removed_Storage.size(); i++) Voxel_Index_Delete(Removed_Storage[i]);
+    Removed_Storage.clear();
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Enforce_Capacity(){
+    // Evictions are journaled as the deletions they cause, a replay must not evict again
+    if (Max_Point_Num <= 0 || Root_Node == nullptr || Journal_Replaying) return;
+    if (Root_Node->TreeSize - Root_Node->invalid_point_num + int(Insert_Buffer.size()) <= Max_Point_Num) return;
+    if (!Insert_Buffer.empty()) Merge_Insert_Buffer();
+    bool background = in_background_rebuild(Root_Node);
+    if (background) pthread_mutex_lock(&working_flag_mutex);
+    // Evict slightly below the capacity so that the cost is paid once every few insertions
+    int evict_num = Root_Node->TreeSize - Root_Node->invalid_point_num - int(Max_Point_Num * (1.0 - EvictionSlackPercentage));
+    BoxPointType keep_box;
+    double cutoff_time = -INFINITY;
+    int cutoff_stamp = INT_MIN, cutoff_num = 0;
+    Evicted_Storage.clear();
+    if (evict_num > 0){
+        switch (Eviction_Policy)
+        {
+        case EVICT_FARTHEST:
+            keep_box = Farthest_Eviction_Box(evict_num);
+            break;
+        case EVICT_OLDEST:
+            cutoff_time = Oldest_Eviction_Time(evict_num);
+            break;
+        case EVICT_LEAST_QUERIED:
+            cutoff_stamp = Least_Queried_Cutoff(evict_num, cutoff_num);
+            Evict_least_queried(&Root_Node, cutoff_stamp, cutoff_num, !background, background || Voxel_Index_Enabled || Journal_Fd >= 0);
+            if (background && rebuild_flag && !Evicted_Storage.empty()) Log_Batch_Points(Evicted_Storage, 0, Evicted_Storage.size()-1, DELETE_POINT);
+            break;
+        default:
+            break;
+        }
+    }
+    if (background) pthread_mutex_unlock(&working_flag_mutex);
+    if (evict_num <= 0) return;
+    // Evictions belong to the Add_Points that caused them, not to a public deletion
+    if (Eviction_Policy == EVICT_FARTHEST) Apply_Delete_Outside_Box(keep_box);
+    if (Eviction_Policy == EVICT_OLDEST) Apply_Delete_Older_Than(cutoff_time);
+    if (Eviction_Policy == EVICT_LEAST_QUERIED && !Evicted_Storage.empty()) Journal_Append(DELETE_POINT, Evicted_Storage.data(), Evicted_Storage.size());
+    if (Eviction_Policy == EVICT_LEAST_QUERIED && Voxel_Index_Enabled){
+        for (int i = 0; i < Evicted_Storage.size(); i++) Voxel_Index_Delete(Evicted_Storage[i]);
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+BoxPointType KD_TREE<PointType, ThreadPolicy>::Farthest_Eviction_Box(int evict_num){
+    // Bisect the half size of the largest box around the center that still leaves evict_num points outside
+    float center[3] = {Eviction_Center.x, Eviction_Center.y, Eviction_Center.z};
+    float range_min[3] = {Root_Node->node_range_x[0], Root_Node->node_range_y[0], Root_Node->node_range_z[0]};
+    float range_max[3] = {Root_Node->node_range_x[1], Root_Node->node_range_y[1], Root_Node->node_range_z[1]};
+    float low = 0.0f, high = 0.0f;
+    for (int k = 0; k < 3; k++) high = max(high, max(center[k] - range_min[k], range_max[k] - center[k]));
+    high = high * 1.01f + 1.0f;
+    BoxPointType boxpoint;
+    for (int i = 0; i < 24; i++){
+        float mid = (low + high) * 0.5f;
+        for (int k = 0; k < 3; k++){
+            boxpoint.vertex_min[k] = center[k] - mid;
+            boxpoint.vertex_max[k] = center[k] + mid;
+        }
+        if (Count_outside_range(Root_Node, boxpoint, Lazy_Tag_Type()) >= evict_num) low = mid;
+            else high = mid;
+    }
+    for (int k = 0; k < 3; k++){
+        boxpoint.vertex_min[k] = center[k] - low;
+        boxpoint.vertex_max[k] = center[k] + low;
+    }
+    return boxpoint;
+}
+
+template <typename PointType, typename ThreadPolicy>
+double KD_TREE<PointType, ThreadPolicy>::Oldest_Eviction_Time(int evict_num){
+    // Bisect the earliest cutoff time before which at least evict_num points lie
+    double low = Root_Node->time_min;
+    double high = nextafter(Root_Node->time_max, INFINITY);
+    for (int i = 0; i < 48 && low < high; i++){
+        double mid = low + (high - low) * 0.5;
+        if (mid <= low || mid >= high) break;
+        if (Count_older_than(Root_Node, mid, Lazy_Tag_Type()) >= evict_num) high = mid;
+            else low = mid;
+    }
+    return high;
+}
+
+template <typename PointType, typename ThreadPolicy>
+atomic<int> & KD_TREE<PointType, ThreadPolicy>::query_stamp(PointType point){
+    Voxel_Key_Type key;
+    key.voxel[0] = int64_t(floor(point.x/Query_Stamp_Cell_Size));
+    key.voxel[1] = int64_t(floor(point.y/Query_Stamp_Cell_Size));
+    key.voxel[2] = int64_t(floor(point.z/Query_Stamp_Cell_Size));
+    return Query_Stamps[Voxel_Key_Hash()(key) % Query_Stamp_Table_Size];
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Least_Queried_Cutoff(int evict_num, int & cutoff_num){
+    // Select the stamp of the evict_num-th least recently queried point, cutoff_num points with exactly that stamp are evicted too
+    vector<int> stamps;
+    stamps.reserve(Root_Node->TreeSize - Root_Node->invalid_point_num);
+    Collect_Query_Stamps(Root_Node, Lazy_Tag_Type(), stamps);
+    evict_num = min(evict_num, int(stamps.size()));
+    cutoff_num = 0;
+    if (evict_num <= 0) return INT_MIN;
+    nth_element(stamps.begin(), stamps.begin() + evict_num - 1, stamps.end());
+    int cutoff_stamp = stamps[evict_num - 1];
+    for (int i = 0; i < evict_num; i++){
+        if (stamps[i] == cutoff_stamp) cutoff_num ++;
+    }
+    return cutoff_stamp;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_removed_points_recording(bool enable){
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&points_deleted_rebuild_mutex_lock); 
+    Removed_Points_Enabled = enable;
+    if (!enable){
+        Removed_Points_Callback = nullptr;
+        PointVector ().swap(Points_deleted);
+        PointVector ().swap(Multithread_Points_deleted);
+    }
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);   
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::set_removed_points_callback(function<void(const PointVector &)> callback){
+    // The callback runs on the thread that performs the rebuild, which is the rebuild thread or executor for large subtrees
+    set_removed_points_recording(bool(callback));
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&points_deleted_rebuild_mutex_lock); 
+    Removed_Points_Callback = callback;
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);   
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::acquire_removed_points(PointVector & removed_points){
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&points_deleted_rebuild_mutex_lock); 
+    // Hand the cache over without copying when the caller passes an empty vector
+    if (removed_points.empty()) removed_points.swap(Points_deleted);
+        else removed_points.insert(removed_points.end(), Points_deleted.begin(), Points_deleted.end());
+    removed_points.insert(removed_points.end(), Multithread_Points_deleted.begin(), Multithread_Points_deleted.end());
+    Points_deleted.clear();
+    Multithread_Points_deleted.clear();
+    if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);   
+    return;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Voxel_Search(PointType point, PointVector &Storage){
+    Storage.clear();
+    if (!Voxel_Index_Enabled){
+        BoxPointType Box_of_Point;
+        Box_of_Point.vertex_min[0] = floor(point.x/downsample_size)*downsample_size;
+        Box_of_Point.vertex_min[1] = floor(point.y/downsample_size)*downsample_size;
+        Box_of_Point.vertex_min[2] = floor(point.z/downsample_size)*downsample_size;
+        for (int k = 0; k < 3; k++) Box_of_Point.vertex_max[k] = Box_of_Point.vertex_min[k] + downsample_size;
+        Search_by_range(Root_Node, Box_of_Point, Storage);
+        return !Storage.empty();
+    }
+    typename Voxel_Map_Type::iterator iter = Voxel_Index.find(voxel_key(point));
+    if (iter == Voxel_Index.end()) return false;
+    Storage = iter->second;
+    return !Storage.empty();
+}
+
+template <typename PointType, typename ThreadPolicy>
+typename KD_TREE<PointType, ThreadPolicy>::Voxel_Key_Type KD_TREE<PointType, ThreadPolicy>::voxel_key(PointType point){
+    Voxel_Key_Type key;
+    key.voxel[0] = int64_t(floor(point.x/downsample_size));
+    key.voxel[1] = int64_t(floor(point.y/downsample_size));
+    key.voxel[2] = int64_t(floor(point.z/downsample_size));
+    return key;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Voxel_Index_Insert(PointType point){
+    Voxel_Index[voxel_key(point)].push_back(point);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Voxel_Index_Delete(PointType point){
+    typename Voxel_Map_Type::iterator iter = Voxel_Index.find(voxel_key(point));
+    if (iter == Voxel_Index.end()) return;
+    PointVector & voxel_points = iter->second;
+    for (int i = 0; i < voxel_points.size(); i++){
+        if (same_point(voxel_points[i], point)){
+            voxel_points[i] = voxel_points.back();
+            voxel_points.pop_back();
+            break;
+        }
+    }
+    if (voxel_points.empty()) Voxel_Index.erase(iter);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Voxel_Index_Delete_Box(BoxPointType boxpoint){
+    int64_t key_min[3], key_max[3];
+    double voxel_num = 1.0;
+    for (int k = 0; k < 3; k++){
+        key_min[k] = int64_t(floor(boxpoint.vertex_min[k]/downsample_size));
+        key_max[k] = int64_t(floor(boxpoint.vertex_max[k]/downsample_size));
+        voxel_num *= double(key_max[k] - key_min[k] + 1);
+    }
+    // Visit the voxels covered by the box, or every occupied voxel when that is fewer
+    if (voxel_num > Voxel_Index.size()){
+        for (typename Voxel_Map_Type::iterator iter = Voxel_Index.begin(); iter != Voxel_Index.end();){
+            Voxel_Index_Delete_Box(iter->second, boxpoint);
+            if (iter->second.empty()) iter = Voxel_Index.erase(iter);
+                else iter++;
+        }
+        return;
+    }
+    Voxel_Key_Type key;
+    for (key.voxel[0] = key_min[0]; key.voxel[0] <= key_max[0]; key.voxel[0]++)
+        for (key.voxel[1] = key_min[1]; key.voxel[1] <= key_max[1]; key.voxel[1]++)
+            for (key.voxel[2] = key_min[2]; key.voxel[2] <= key_max[2]; key.voxel[2]++){
+                typename Voxel_Map_Type::iterator iter = Voxel_Index.find(key);
+                if (iter == Voxel_Index.end()) continue;
+                Voxel_Index_Delete_Box(iter->second, boxpoint);
+                if (iter->second.empty()) Voxel_Index.erase(iter);
+            }
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Voxel_Index_Delete_Box(PointVector & voxel_points, const BoxPointType & boxpoint){
+    int i = 0;
+    while (i < voxel_points.size()){
+        const PointType & p = voxel_points[i];
+        if (boxpoint.vertex_min[0] <= p.x && boxpoint.vertex_max[0] > p.x && boxpoint.vertex_min[1] <= p.y && boxpoint.vertex_max[1] > p.y && boxpoint.vertex_min[2] <= p.z && boxpoint.vertex_max[2] > p.z){
+            voxel_points[i] = voxel_points.back();
+            voxel_points.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::flush_insert_buffer(){
+    if (Insert_Buffer.empty()) return;
+    Trace_Append(TRACE_FLUSH_INSERT_BUFFER, nullptr, 0);
+    Merge_Insert_Buffer();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Merge_Insert_Buffer(){
+    if (Insert_Buffer.empty()) return;
+    if (Root_Node == nullptr){
+        if (STATIC_ROOT_NODE == nullptr){
+            STATIC_ROOT_NODE = new KD_TREE_NODE;
+            InitTreeNode(STATIC_ROOT_NODE);
+        }
+        BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, Insert_Buffer.size()-1, Insert_Buffer);
+        Update(STATIC_ROOT_NODE);
+        STATIC_ROOT_NODE->TreeSize = 0;
+        Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+    } else if (!in_background_rebuild(Root_Node)){
+        Add_by_batch(&Root_Node, Insert_Buffer, 0, Insert_Buffer.size()-1, true);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        Add_by_batch(&Root_Node, Insert_Buffer, 0, Insert_Buffer.size()-1, false);
+        if (rebuild_flag) Log_Batch_Points(Insert_Buffer, 0, Insert_Buffer.size()-1, ADD_POINT);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    Insert_Buffer.clear();
+    for (int k = 0; k < 3; k++) Insert_Buffer_Coord[k].clear();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Buffer_Search(int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist, const Time_Window_Type * window){
+    int n = Insert_Buffer.size();
+    const float * bx = Insert_Buffer_Coord[0].data();
+    const float * by = Insert_Buffer_Coord[1].data();
+    const float * bz = Insert_Buffer_Coord[2].data();
+    Insert_Buffer_Dist.resize(n);
+    float * dist = Insert_Buffer_Dist.data();
+    // Flat loop over the coordinate arrays so that the compiler can vectorize the distance computation
+    for (int i = 0; i < n; i++){
+        dist[i] = (bx[i]-point.x)*(bx[i]-point.x) + (by[i]-point.y)*(by[i]-point.y) + (bz[i]-point.z)*(bz[i]-point.z);
+    }
+    double max_dist_sqr = max_dist * max_dist;
+    for (int i = 0; i < n; i++){
+        if (dist[i] <= max_dist_sqr && (q.size() < k_nearest || dist[i] < q.top().dist)){
+            if (window != nullptr){
+                double point_time = Point_Timestamp(Insert_Buffer[i]);
+                if (point_time < window->time_min || point_time > window->time_max) continue;
+            }
+            if (q.size() >= k_nearest) q.pop();
+            PointType_CMP current_point{Insert_Buffer[i], dist[i]};
+            q.push(current_point);
+        }
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Buffer_Search_by_range(const BoxPointType &boxpoint, PointVector &Storage){
+    const float * bx = Insert_Buffer_Coord[0].data();
+    const float * by = Insert_Buffer_Coord[1].data();
+    const float * bz = Insert_Buffer_Coord[2].data();
+    for (int i = 0; i < Insert_Buffer.size(); i++){
+        if (boxpoint.vertex_min[0] <= bx[i] && boxpoint.vertex_max[0] > bx[i] && boxpoint.vertex_min[1] <= by[i] && boxpoint.vertex_max[1] > by[i] && boxpoint.vertex_min[2] <= bz[i] && boxpoint.vertex_max[2] > bz[i]){
+            Storage.push_back(Insert_Buffer[i]);
+        }
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Buffer_Search_by_radius(PointType point, float radius, PointVector &Storage){
+    int n = Insert_Buffer.size();
+    const float * bx = Insert_Buffer_Coord[0].data();
+    const float * by = Insert_Buffer_Coord[1].data();
+    const float * bz = Insert_Buffer_Coord[2].data();
+    Insert_Buffer_Dist.resize(n);
+    float * dist = Insert_Buffer_Dist.data();
+    for (int i = 0; i < n; i++){
+        dist[i] = (bx[i]-point.x)*(bx[i]-point.x) + (by[i]-point.y)*(by[i]-point.y) + (bz[i]-point.z)*(bz[i]-point.z);
+    }
+    float radius_sqr = radius * radius;
+    for (int i = 0; i < n; i++){
+        if (dist[i] <= radius_sqr) Storage.push_back(Insert_Buffer[i]);
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Buffer_Delete(PointType point){
+    for (int i = 0; i < Insert_Buffer.size(); i++){
+        if (same_point(Insert_Buffer[i], point)){
+            Buffer_Remove(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Buffer_Delete_by_range(const BoxPointType &boxpoint){
+    int tmp_counter = 0;
+    int i = 0;
+    while (i < Insert_Buffer.size()){
+        const PointType & p = Insert_Buffer[i];
+        if (boxpoint.vertex_min[0] <= p.x && boxpoint.vertex_max[0] > p.x && boxpoint.vertex_min[1] <= p.y && boxpoint.vertex_max[1] > p.y && boxpoint.vertex_min[2] <= p.z && boxpoint.vertex_max[2] > p.z){
+            Buffer_Remove(i);
+            tmp_counter ++;
         } else {
-            Operation_Logger_Type operation;
-            operation.point = PointToDel[i];
-            operation.op = DELETE_POINT;
-            pthread_mutex_lock(&working_flag_mutex);        
-            Delete_by_point(&Root_Node, PointToDel[i], false);
-            if (rebuild_flag){
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-            }
-            pthread_mutex_unlock(&working_flag_mutex);
-        }      
-    }      
-    return;
+            i++;
+        }
+    }
+    return tmp_counter;
 }
 
-template <typename PointType>
-int KD_TREE<PointType>::Delete_Point_Boxes(vector<BoxPointType> & BoxPoints){
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Buffer_Delete_outside_range(const BoxPointType &boxpoint){
     int tmp_counter = 0;
-    for (int i=0;i < BoxPoints.size();i++){ 
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){               
-            tmp_counter += Delete_by_range(&Root_Node ,BoxPoints[i], true, false);
+    int i = 0;
+    while (i < Insert_Buffer.size()){
+        const PointType & p = Insert_Buffer[i];
+        if (boxpoint.vertex_min[0] <= p.x && boxpoint.vertex_max[0] > p.x && boxpoint.vertex_min[1] <= p.y && boxpoint.vertex_max[1] > p.y && boxpoint.vertex_min[2] <= p.z && boxpoint.vertex_max[2] > p.z){
+            i++;
         } else {
-            Operation_Logger_Type operation;
-            operation.boxpoint = BoxPoints[i];
-            operation.op = DELETE_BOX;     
-            pthread_mutex_lock(&working_flag_mutex); 
-            tmp_counter += Delete_by_range(&Root_Node ,BoxPoints[i], false, false);
-            if (rebuild_flag){
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-            }                
-            pthread_mutex_unlock(&working_flag_mutex);
+            if (Voxel_Index_Enabled) Voxel_Index_Delete(p);
+            Buffer_Remove(i);
+            tmp_counter ++;
         }
-    } 
+    }
     return tmp_counter;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::acquire_removed_points(PointVector & removed_points){
-    pthread_mutex_lock(&points_deleted_rebuild_mutex_lock); 
-    for (int i = 0; i < Points_deleted.size();i++){
-        removed_points.push_back(Points_deleted[i]);
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Buffer_Delete_older_than(double time){
+    int tmp_counter = 0;
+    int i = 0;
+    while (i < Insert_Buffer.size()){
+        if (Point_Timestamp(Insert_Buffer[i]) < time){
+            if (Voxel_Index_Enabled) Voxel_Index_Delete(Insert_Buffer[i]);
+            Buffer_Remove(i);
+            tmp_counter ++;
+        } else {
+            i++;
+        }
     }
-    for (int i = 0; i < Multithread_Points_deleted.size();i++){
-        removed_points.push_back(Multithread_Points_deleted[i]);
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Buffer_Remove(int index){
+    Insert_Buffer[index] = Insert_Buffer.back();
+    Insert_Buffer.pop_back();
+    for (int k = 0; k < 3; k++){
+        Insert_Buffer_Coord[k][index] = Insert_Buffer_Coord[k].back();
+        Insert_Buffer_Coord[k].pop_back();
     }
-    Points_deleted.clear();
-    Multithread_Points_deleted.clear();
-    pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);   
-    return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage, vector<KD_TREE_NODE *> * node_pool){
+    if (l>r) return;
+    vector<Build_Split_Type> splits;
+    Partition_Points(l, r, Storage, splits);
+    int split_counter = 0;
+    Build_by_splits(root, l, r, Storage, splits, split_counter, node_pool);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Partition_Points(int l, int r, PointVector & Storage, vector<Build_Split_Type> & splits){
+    // Partition compact copies of the points, then move the full points into tree order only once
+    int n = r-l+1;
+    vector<Build_Point_Type> build_points(n), build_buffer;
+    splits.clear();
+    splits.reserve(n);
+    for (int i = 0; i < n; i++){
+        build_points[i].coord[0] = Storage[l+i].x;
+        build_points[i].coord[1] = Storage[l+i].y;
+        build_points[i].coord[2] = Storage[l+i].z;
+        build_points[i].index = l+i;
+    }
+    if (n >= HistogramSelectMinSize) build_buffer.resize(n);
+    Partition_by_index(0, n-1, build_points, build_buffer, splits);
+    PointVector ordered_points(n);
+    for (int i = 0; i < n; i++) ordered_points[i] = Storage[build_points[i].index];
+    if (l == 0 && r == Storage.size()-1){
+        Storage.swap(ordered_points);
+    } else {
+        copy(ordered_points.begin(), ordered_points.end(), Storage.begin()+l);
+    }
+    for (int i = 0; i < splits.size(); i++) splits[i].mid += l;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Partition_by_index(int l, int r, vector<Build_Point_Type> & build_points, vector<Build_Point_Type> & build_buffer, vector<Build_Split_Type> & splits){
     if (l>r) return;
-    *root = new KD_TREE_NODE;
-    InitTreeNode(*root);
     int mid = (l+r)>>1;
     int div_axis = 0;
     int i;
@@ -583,69 +2422,240 @@ void KD_TREE<PointType>::BuildTree(KD_TREE_NODE ** root, int l, int r, PointVect
     float max_value[3] = {-INFINITY, -INFINITY, -INFINITY};
     float dim_range[3] = {0,0,0};
     for (i=l;i<=r;i++){
-        min_value[0] = min(min_value[0], Storage[i].x);
-        min_value[1] = min(min_value[1], Storage[i].y);
-        min_value[2] = min(min_value[2], Storage[i].z);
-        max_value[0] = max(max_value[0], Storage[i].x);
-        max_value[1] = max(max_value[1], Storage[i].y);
-        max_value[2] = max(max_value[2], Storage[i].z);
+        min_value[0] = min(min_value[0], build_points[i].coord[0]);
+        min_value[1] = min(min_value[1], build_points[i].coord[1]);
+        min_value[2] = min(min_value[2], build_points[i].coord[2]);
+        max_value[0] = max(max_value[0], build_points[i].coord[0]);
+        max_value[1] = max(max_value[1], build_points[i].coord[1]);
+        max_value[2] = max(max_value[2], build_points[i].coord[2]);
     }
     // Select the longest dimension as division axis
     for (i=0;i<3;i++) dim_range[i] = max_value[i] - min_value[i];
     for (i=1;i<3;i++) if (dim_range[i] > dim_range[div_axis]) div_axis = i;
-    // Divide by the division axis and recursively build.
-
-    (*root)->division_axis = div_axis;
-    switch (div_axis)
+    switch (Split_Strategy)
     {
-    case 0:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_x);
+    case SPLIT_SLIDING_MIDPOINT:
+        mid = Sliding_Midpoint_Split(l, r, build_points, div_axis, (min_value[div_axis] + max_value[div_axis]) * 0.5f);
         break;
-    case 1:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_y);
-        break;
-    case 2:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_z);
+    case SPLIT_SURFACE_AREA:
+        mid = Surface_Area_Split(l, r, build_points, min_value, max_value, div_axis);
         break;
     default:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_x);
         break;
-    }  
-    (*root)->point = Storage[mid]; 
+    }
+    // Divide by the division axis and recursively partition, the splits are recorded in pre-order for Build_by_splits
+    Select_by_histogram(l, r, mid, div_axis, min_value[div_axis], max_value[div_axis], build_points, build_buffer);
+    splits.push_back(Build_Split_Type{mid, div_axis});
+    Partition_by_index(l, mid-1, build_points, build_buffer, splits);
+    Partition_by_index(mid+1, r, build_points, build_buffer, splits);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Select_by_histogram(int l, int r, int mid, int div_axis, float min_value, float max_value, vector<Build_Point_Type> & build_points, vector<Build_Point_Type> & build_buffer){
+    auto axis_cmp = [div_axis](const Build_Point_Type & a, const Build_Point_Type & b){
+        return a.coord[div_axis] < b.coord[div_axis];
+    };
+    if (r-l+1 < HistogramSelectMinSize || max_value - min_value <= EPSS){
+        nth_element(begin(build_points)+l, begin(build_points)+mid, begin(build_points)+r+1, axis_cmp);
+        return;
+    }
+    // Count the keys per bin, then scatter them below, inside and above the bin holding the split rank
+    int bin_num[HistogramSelectBins] = {0};
+    float scale = HistogramSelectBins / (max_value - min_value);
+    for (int i = l; i <= r; i++) bin_num[min(int((build_points[i].coord[div_axis] - min_value) * scale), HistogramSelectBins-1)] ++;
+    int lower_num = 0, target_bin = 0;
+    while (lower_num + bin_num[target_bin] <= mid - l) lower_num += bin_num[target_bin++];
+    int offset[3] = {0, lower_num, lower_num + bin_num[target_bin]};
+    for (int i = l; i <= r; i++){
+        int bin = min(int((build_points[i].coord[div_axis] - min_value) * scale), HistogramSelectBins-1);
+        build_buffer[offset[(bin > target_bin) - (bin < target_bin) + 1]++] = build_points[i];
+    }
+    copy(build_buffer.begin(), build_buffer.begin()+r-l+1, build_points.begin()+l);
+    nth_element(begin(build_points)+l+lower_num, begin(build_points)+mid, begin(build_points)+l+lower_num+bin_num[target_bin], axis_cmp);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Build_by_splits(KD_TREE_NODE ** root, int l, int r, PointVector & Storage, const vector<Build_Split_Type> & splits, int & split_counter, vector<KD_TREE_NODE *> * node_pool, int storage_offset){
+    if (l>r) return;
+    *root = new_tree_node(node_pool);
+    InitTreeNode(*root);
+    const Build_Split_Type & split = splits[split_counter++];
+    int mid = split.mid;
+    (*root)->division_axis = split.axis;
+    (*root)->point = Storage[mid - storage_offset]; 
     KD_TREE_NODE * left_son = nullptr, * right_son = nullptr;
-    BuildTree(&left_son, l, mid-1, Storage);
-    BuildTree(&right_son, mid+1, r, Storage);  
+    Build_by_splits(&left_son, l, mid-1, Storage, splits, split_counter, node_pool, storage_offset);
+    Build_by_splits(&right_son, mid+1, r, Storage, splits, split_counter, node_pool, storage_offset);  
     (*root)->left_son_ptr = left_son;
     (*root)->right_son_ptr = right_son;
     Update((*root));  
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Rebuild(KD_TREE_NODE ** root){    
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Build_by_file_splits(KD_TREE_NODE ** root, int l, int r, const Point_File_Type & file, const vector<Build_Point_Type> & build_points, const vector<Build_Split_Type> & splits, int & split_counter, PointVector & chunk){
+    if (l>r) return;
+    // A subtree fitting in a chunk converts its points together, the nodes above it convert their own point only
+    if (r-l+1 <= Point_File_Chunk_Size){
+        chunk.resize(r-l+1);
+        for (int i = l; i <= r; i++) Read_File_Point(file, build_points[i].index, chunk[i-l]);
+        Build_by_splits(root, l, r, chunk, splits, split_counter, &Node_Pool, l);
+        return;
+    }
+    *root = new_tree_node(&Node_Pool);
+    InitTreeNode(*root);
+    const Build_Split_Type & split = splits[split_counter++];
+    int mid = split.mid;
+    (*root)->division_axis = split.axis;
+    Read_File_Point(file, build_points[mid].index, (*root)->point);
+    KD_TREE_NODE * left_son = nullptr, * right_son = nullptr;
+    Build_by_file_splits(&left_son, l, mid-1, file, build_points, splits, split_counter, chunk);
+    Build_by_file_splits(&right_son, mid+1, r, file, build_points, splits, split_counter, chunk);
+    (*root)->left_son_ptr = left_son;
+    (*root)->right_son_ptr = right_son;
+    Update((*root));
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Sliding_Midpoint_Split(int l, int r, vector<Build_Point_Type> & build_points, int div_axis, float split_value){
+    // Split at the middle of the extent, the node takes the first point at or above it
+    int left_num = 0;
+    for (int i = l; i <= r; i++){
+        if (build_points[i].coord[div_axis] < split_value) left_num ++;
+    }
+    return Balanced_Split_Index(l, r, l + left_num);
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Surface_Area_Split(int l, int r, vector<Build_Point_Type> & build_points, const float min_value[3], const float max_value[3], int & div_axis){
+    if (r - l + 1 < 2 * SurfaceAreaSplitBins) return (l+r)>>1;
+    // Bin the points along every axis and pick the boundary minimizing the sum of point count times box surface area on both sides
+    double best_cost = INFINITY;
+    int best_mid = (l+r)>>1;
+    for (int axis = 0; axis < 3; axis++){
+        float range = max_value[axis] - min_value[axis];
+        if (range <= EPSS) continue;
+        int bin_num[SurfaceAreaSplitBins] = {0};
+        float bin_min[SurfaceAreaSplitBins][3], bin_max[SurfaceAreaSplitBins][3];
+        for (int b = 0; b < SurfaceAreaSplitBins; b++){
+            for (int k = 0; k < 3; k++){
+                bin_min[b][k] = INFINITY;
+                bin_max[b][k] = -INFINITY;
+            }
+        }
+        for (int i = l; i <= r; i++){
+            const float * coord = build_points[i].coord;
+            int b = min(int((coord[axis] - min_value[axis]) / range * SurfaceAreaSplitBins), SurfaceAreaSplitBins - 1);
+            bin_num[b] ++;
+            for (int k = 0; k < 3; k++){
+                bin_min[b][k] = min(bin_min[b][k], coord[k]);
+                bin_max[b][k] = max(bin_max[b][k], coord[k]);
+            }
+        }
+        double right_area[SurfaceAreaSplitBins];
+        int right_num[SurfaceAreaSplitBins];
+        float box_min[3] = {INFINITY, INFINITY, INFINITY}, box_max[3] = {-INFINITY, -INFINITY, -INFINITY};
+        int num = 0;
+        for (int b = SurfaceAreaSplitBins - 1; b > 0; b--){
+            num += bin_num[b];
+            for (int k = 0; k < 3; k++){
+                box_min[k] = min(box_min[k], bin_min[b][k]);
+                box_max[k] = max(box_max[k], bin_max[b][k]);
+            }
+            double dx = max(box_max[0] - box_min[0], 0.0f), dy = max(box_max[1] - box_min[1], 0.0f), dz = max(box_max[2] - box_min[2], 0.0f);
+            right_area[b] = dx * dy + dy * dz + dz * dx;
+            right_num[b] = num;
+        }
+        for (int k = 0; k < 3; k++){
+            box_min[k] = INFINITY;
+            box_max[k] = -INFINITY;
+        }
+        num = 0;
+        for (int b = 0; b < SurfaceAreaSplitBins - 1; b++){
+            num += bin_num[b];
+            for (int k = 0; k < 3; k++){
+                box_min[k] = min(box_min[k], bin_min[b][k]);
+                box_max[k] = max(box_max[k], bin_max[b][k]);
+            }
+            if (num == 0 || right_num[b+1] == 0) continue;
+            double dx = max(box_max[0] - box_min[0], 0.0f), dy = max(box_max[1] - box_min[1], 0.0f), dz = max(box_max[2] - box_min[2], 0.0f);
+            int mid = Balanced_Split_Index(l, r, l + num);
+            // Splits moved by the balance clamp no longer match the bins, cost them by their clamped counts
+            double cost = double(mid - l) * (dx * dy + dy * dz + dz * dx) + double(r - mid) * right_area[b+1];
+            if (cost < best_cost){
+                best_cost = cost;
+                best_mid = mid;
+                div_axis = axis;
+            }
+        }
+    }
+    return best_mid;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Balanced_Split_Index(int l, int r, int mid){
+    // Keep the split inside the balance criterion, otherwise the fresh subtree would be rebuilt again right away
+    if (r - l < 2) return (l+r)>>1;
+    int lo = l + int(ceil((1 - balance_criterion_param) * (r - l)));
+    int hi = l + int(floor(balance_criterion_param * (r - l)));
+    if (lo > hi) return (l+r)>>1;
+    return min(max(mid, lo), hi);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Rebuild(KD_TREE_NODE ** root){    
     KD_TREE_NODE * father_ptr;
-    if ((*root)->TreeSize >= Multi_Thread_Rebuild_Point_Num) { 
+    if (ThreadPolicy::Multi_Thread && (*root)->TreeSize >= multi_thread_rebuild_point_num && Rebuild_Policy.mode != SYNC_REBUILD) { 
         if (!pthread_mutex_trylock(&rebuild_ptr_mutex_lock)){     
             if (Rebuild_Ptr == nullptr || ((*root)->TreeSize > (*Rebuild_Ptr)->TreeSize)) {
                 Rebuild_Ptr = root;          
+                Rebuild_Trigger = Rebuild_Trigger_of(*root);
             }
+            bool submit_task = Rebuild_Policy.mode == EXECUTOR_REBUILD && !rebuild_task_pending;
+            if (submit_task) rebuild_task_pending = true;
             pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+            if (submit_task) Rebuild_Policy.executor([this]{ executor_rebuild(); });
         }
+    } else if (Defer_Rebuild) {
+        (*root)->rebuild_pending = true;
+        (*root)->tree_rebuild_pending = true;
     } else {
+        LATENCY_SCOPE(LATENCY_REBUILD);
+        RebuildEventType event;
+        event.trigger = Rebuild_Trigger_of(*root);
         father_ptr = (*root)->father_ptr;
         int size_rec = (*root)->TreeSize;
+        auto rebuild_start = chrono::high_resolution_clock::now();
         PCL_Storage.clear();
-        flatten(*root, PCL_Storage, DELETE_POINTS_REC);
-        delete_tree_nodes(root);
-        BuildTree(root, 0, PCL_Storage.size()-1, PCL_Storage);
+        flatten(*root, PCL_Storage, Removed_Points_Enabled ? DELETE_POINTS_REC : NOT_RECORD);
+        auto flatten_end = chrono::high_resolution_clock::now();
+        recycle_tree_nodes(root, Node_Pool);
+        BuildTree(root, 0, PCL_Storage.size()-1, PCL_Storage, &Node_Pool);
+        release_node_pool(Node_Pool, Max_Recycled_Node_Num);
+        auto rebuild_end = chrono::high_resolution_clock::now();
+        Rebuild_Time_Total += chrono::duration_cast<chrono::nanoseconds>(rebuild_end - rebuild_start).count();
+        Rebuild_Point_Total += size_rec;
         if (*root != nullptr) (*root)->father_ptr = father_ptr;
         if (*root == Root_Node) STATIC_ROOT_NODE->left_son_ptr = *root;
+        // The callback may be replaced concurrently, it is taken with the removed points under their lock and called outside of it
+        PointVector removed_points;
+        if (ThreadPolicy::Multi_Thread) pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+        function<void(const PointVector &)> removed_points_callback = Removed_Points_Callback;
+        if (removed_points_callback) removed_points.swap(Points_deleted);
+        if (ThreadPolicy::Multi_Thread) pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+        if (!removed_points.empty()) removed_points_callback(removed_points);
+        event.tree_size = size_rec;
+        event.valid_size = PCL_Storage.size();
+        event.flatten_us = chrono::duration_cast<chrono::nanoseconds>(flatten_end - rebuild_start).count() / 1e3;
+        event.build_us = chrono::duration_cast<chrono::nanoseconds>(rebuild_end - flatten_end).count() / 1e3;
+        event.total_us = event.flatten_us + event.build_us;
+        Record_Rebuild(event);
     } 
     return;
 }
 
-template <typename PointType>
-int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxpoint, bool allow_rebuild, bool is_downsample){   
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxpoint, bool allow_rebuild, bool is_downsample){   
     if ((*root) == nullptr || (*root)->tree_deleted) return 0;
     (*root)->working_flag = true;
     Push_Down(*root);
@@ -677,7 +2687,7 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxp
     if (is_downsample) delete_box_log.op = DOWNSAMPLE_DELETE;
         else delete_box_log.op = DELETE_BOX;
     delete_box_log.boxpoint = boxpoint;
-    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){
+    if (!in_background_rebuild((*root)->left_son_ptr)){
         tmp_counter += Delete_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, is_downsample);
     } else {
         pthread_mutex_lock(&working_flag_mutex);
@@ -689,7 +2699,7 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxp
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){
+    if (!in_background_rebuild((*root)->right_son_ptr)){
         tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, is_downsample);
     } else {
         pthread_mutex_lock(&working_flag_mutex);
@@ -702,15 +2712,248 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxp
         pthread_mutex_unlock(&working_flag_mutex);
     }    
     Update(*root);     
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num) Rebuild_Ptr = nullptr; 
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild) Rebuild(root);
     if ((*root) != nullptr) (*root)->working_flag = false;
     return tmp_counter;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild){   
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Delete_outside_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild, bool record){
+    if ((*root) == nullptr || (*root)->tree_deleted) return 0;
+    // Nothing to remove if the subtree lies inside the box
+    if (boxpoint.vertex_min[0] <= (*root)->node_range_x[0] && boxpoint.vertex_max[0] > (*root)->node_range_x[1] && boxpoint.vertex_min[1] <= (*root)->node_range_y[0] && boxpoint.vertex_max[1] > (*root)->node_range_y[1] && boxpoint.vertex_min[2] <= (*root)->node_range_z[0] && boxpoint.vertex_max[2] > (*root)->node_range_z[1]) return 0;
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int tmp_counter = 0;
+    // Tombstone the whole subtree if it lies outside the box
+    if (boxpoint.vertex_max[0] <= (*root)->node_range_x[0] || boxpoint.vertex_min[0] > (*root)->node_range_x[1] || boxpoint.vertex_max[1] <= (*root)->node_range_y[0] || boxpoint.vertex_min[1] > (*root)->node_range_y[1] || boxpoint.vertex_max[2] <= (*root)->node_range_z[0] || boxpoint.vertex_min[2] > (*root)->node_range_z[1]){
+        if (record) flatten(*root, Removed_Storage, NOT_RECORD);
+        (*root)->tree_deleted = true;
+        (*root)->point_deleted = true;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
+        (*root)->invalid_point_num = (*root)->TreeSize;
+        (*root)->working_flag = false;
+        return tmp_counter;
+    }
+    if (!(*root)->point_deleted && !(boxpoint.vertex_min[0] <= (*root)->point.x && boxpoint.vertex_max[0] > (*root)->point.x && boxpoint.vertex_min[1] <= (*root)->point.y && boxpoint.vertex_max[1] > (*root)->point.y && boxpoint.vertex_min[2] <= (*root)->point.z && boxpoint.vertex_max[2] > (*root)->point.z)){
+        if (record) Removed_Storage.push_back((*root)->point);
+        (*root)->point_deleted = true;
+        tmp_counter += 1;
+    }
+    Operation_Logger_Type delete_box_log;
+    delete_box_log.op = DELETE_OUTSIDE_BOX;
+    delete_box_log.boxpoint = boxpoint;
+    if (!in_background_rebuild((*root)->left_son_ptr)){
+        tmp_counter += Delete_outside_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, record);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_outside_range(&((*root)->left_son_ptr), boxpoint, false, record);
+        if (rebuild_flag){
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(delete_box_log);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if (!in_background_rebuild((*root)->right_son_ptr)){
+        tmp_counter += Delete_outside_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, record);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_outside_range(&((*root)->right_son_ptr), boxpoint, false, record);
+        if (rebuild_flag){
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(delete_box_log);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }    
+    Update(*root);     
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild) Rebuild(root);
+    if ((*root) != nullptr) (*root)->working_flag = false;
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Delete_older_than(KD_TREE_NODE ** root, double time, bool allow_rebuild, bool record){
+    // time_min/time_max cover deleted points too, so both bounds are conservative
+    if ((*root) == nullptr || (*root)->tree_deleted || (*root)->time_min >= time) return 0;
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int tmp_counter = 0;
+    if ((*root)->time_max < time){
+        if (record) flatten(*root, Removed_Storage, NOT_RECORD);
+        (*root)->tree_deleted = true;
+        (*root)->point_deleted = true;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
+        (*root)->invalid_point_num = (*root)->TreeSize;
+        (*root)->working_flag = false;
+        return tmp_counter;
+    }
+    if (!(*root)->point_deleted && Point_Timestamp((*root)->point) < time){
+        if (record) Removed_Storage.push_back((*root)->point);
+        (*root)->point_deleted = true;
+        tmp_counter += 1;
+    }
+    Operation_Logger_Type delete_time_log;
+    delete_time_log.op = DELETE_OLDER_THAN;
+    delete_time_log.timestamp = time;
+    if (!in_background_rebuild((*root)->left_son_ptr)){
+        tmp_counter += Delete_older_than(&((*root)->left_son_ptr), time, allow_rebuild, record);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_older_than(&((*root)->left_son_ptr), time, false, record);
+        if (rebuild_flag){
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(delete_time_log);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if (!in_background_rebuild((*root)->right_son_ptr)){
+        tmp_counter += Delete_older_than(&((*root)->right_son_ptr), time, allow_rebuild, record);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_older_than(&((*root)->right_son_ptr), time, false, record);
+        if (rebuild_flag){
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(delete_time_log);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }    
+    Update(*root);     
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild) Rebuild(root);
+    if ((*root) != nullptr) (*root)->working_flag = false;
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Collect_Query_Stamps(KD_TREE_NODE * root, Lazy_Tag_Type tag, vector<int> & stamps){
+    if (root == nullptr) return;
+    bool point_deleted, point_downsample_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    if (Resolve_Lazy_Tag(root, tag, point_deleted, point_downsample_deleted, left_tag, right_tag)) return;
+    if (!point_deleted) stamps.push_back(query_stamp(root->point).load(memory_order_relaxed));
+    if (!in_background_rebuild(root->left_son_ptr)){
+        Collect_Query_Stamps(root->left_son_ptr, left_tag, stamps);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        Collect_Query_Stamps(root->left_son_ptr, left_tag, stamps);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if (!in_background_rebuild(root->right_son_ptr)){
+        Collect_Query_Stamps(root->right_son_ptr, right_tag, stamps);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        Collect_Query_Stamps(root->right_son_ptr, right_tag, stamps);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Evict_least_queried(KD_TREE_NODE ** root, int cutoff_stamp, int & cutoff_num, bool allow_rebuild, bool record){
+    if ((*root) == nullptr || (*root)->tree_deleted) return 0;
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int tmp_counter = 0;
+    if (!(*root)->point_deleted){
+        int stamp = query_stamp((*root)->point).load(memory_order_relaxed);
+        if (stamp < cutoff_stamp || (stamp == cutoff_stamp && cutoff_num > 0)){
+            if (stamp == cutoff_stamp) cutoff_num --;
+            if (record) Evicted_Storage.push_back((*root)->point);
+            (*root)->point_deleted = true;
+            tmp_counter ++;
+        }
+    }
+    KD_TREE_NODE ** sons[2] = {&(*root)->left_son_ptr, &(*root)->right_son_ptr};
+    for (int i = 0; i < 2; i++){
+        if (!in_background_rebuild(*sons[i])){
+            tmp_counter += Evict_least_queried(sons[i], cutoff_stamp, cutoff_num, allow_rebuild, record);
+        } else {
+            pthread_mutex_lock(&working_flag_mutex);
+            int record_begin = Evicted_Storage.size();
+            tmp_counter += Evict_least_queried(sons[i], cutoff_stamp, cutoff_num, false, true);
+            if (rebuild_flag && Evicted_Storage.size() > record_begin) Log_Batch_Points(Evicted_Storage, record_begin, Evicted_Storage.size()-1, DELETE_POINT);
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    Update(*root);
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild) Rebuild(root);
+    if ((*root) != nullptr) (*root)->working_flag = false;
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Count_outside_range(KD_TREE_NODE * root, const BoxPointType & boxpoint, Lazy_Tag_Type tag){
+    if (root == nullptr) return 0;
+    bool point_deleted, point_downsample_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    if (Resolve_Lazy_Tag(root, tag, point_deleted, point_downsample_deleted, left_tag, right_tag)) return 0;
+    // Ranges and counts below a pending tag that revived the subtree are stale, such a subtree is counted point by point
+    if (!tag.pushed){
+        if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1]) return 0;
+        if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1] || boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1] || boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1]) return root->TreeSize - root->invalid_point_num;
+    }
+    int tmp_counter = 0;
+    if (!point_deleted && !(boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)) tmp_counter ++;
+    if (!in_background_rebuild(root->left_son_ptr)){
+        tmp_counter += Count_outside_range(root->left_son_ptr, boxpoint, left_tag);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Count_outside_range(root->left_son_ptr, boxpoint, left_tag);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if (!in_background_rebuild(root->right_son_ptr)){
+        tmp_counter += Count_outside_range(root->right_son_ptr, boxpoint, right_tag);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Count_outside_range(root->right_son_ptr, boxpoint, right_tag);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Count_older_than(KD_TREE_NODE * root, double time, Lazy_Tag_Type tag){
+    if (root == nullptr) return 0;
+    bool point_deleted, point_downsample_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    if (Resolve_Lazy_Tag(root, tag, point_deleted, point_downsample_deleted, left_tag, right_tag) || root->time_min >= time) return 0;
+    // Below a pending tag that did not delete the subtree, Push_Down would reset invalid_point_num to down_del_num
+    if (root->time_max < time) return root->TreeSize - (tag.pushed ? root->down_del_num : root->invalid_point_num);
+    int tmp_counter = 0;
+    if (!point_deleted && Point_Timestamp(root->point) < time) tmp_counter ++;
+    if (!in_background_rebuild(root->left_son_ptr)){
+        tmp_counter += Count_older_than(root->left_son_ptr, time, left_tag);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Count_older_than(root->left_son_ptr, time, left_tag);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if (!in_background_rebuild(root->right_son_ptr)){
+        tmp_counter += Count_older_than(root->right_son_ptr, time, right_tag);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Count_older_than(root->right_son_ptr, time, right_tag);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild){   
     if ((*root) == nullptr || (*root)->tree_deleted) return;
     (*root)->working_flag = true;
     Push_Down(*root);
@@ -725,7 +2968,7 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE ** root, PointType point,
     delete_log.op = DELETE_POINT;
     delete_log.point = point;     
     if (((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z)){           
-        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){          
+        if (!in_background_rebuild((*root)->left_son_ptr)){          
             Delete_by_point(&(*root)->left_son_ptr, point, allow_rebuild);         
         } else {
             pthread_mutex_lock(&working_flag_mutex);
@@ -738,7 +2981,7 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE ** root, PointType point,
             pthread_mutex_unlock(&working_flag_mutex);
         }
     } else {       
-        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){         
+        if (!in_background_rebuild((*root)->right_son_ptr)){         
             Delete_by_point(&(*root)->right_son_ptr, point, allow_rebuild);         
         } else {
             pthread_mutex_lock(&working_flag_mutex); 
@@ -752,15 +2995,62 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE ** root, PointType point,
         }        
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num) Rebuild_Ptr = nullptr; 
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild) Rebuild(root);
     if ((*root) != nullptr) (*root)->working_flag = false;   
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild){
+template <typename PointType, typename ThreadPolicy>
+int KD_TREE<PointType, ThreadPolicy>::Delete_by_batch(KD_TREE_NODE ** root, PointVector & Storage, int l, int r, bool allow_rebuild){
+    if (l > r || (*root) == nullptr || (*root)->tree_deleted) return 0;
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int tmp_counter = 0;
+    // One target consumes the point of this node, the rest (including duplicates) continue down
+    if (!(*root)->point_deleted){
+        for (int i = l; i <= r; i++){
+            if (same_point((*root)->point, Storage[i])){
+                (*root)->point_deleted = true;
+                tmp_counter ++;
+                swap(Storage[i], Storage[r]);
+                r--;
+                break;
+            }
+        }
+    }
+    int axis = (*root)->division_axis;
+    PointType split_point = (*root)->point;
+    int mid = partition(begin(Storage)+l, begin(Storage)+r+1, [axis, &split_point](const PointType & p){
+        return (axis == 0 && p.x < split_point.x) || (axis == 1 && p.y < split_point.y) || (axis == 2 && p.z < split_point.z);
+    }) - begin(Storage);
+    if (!in_background_rebuild((*root)->left_son_ptr)){
+        tmp_counter += Delete_by_batch(&(*root)->left_son_ptr, Storage, l, mid-1, allow_rebuild);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_by_batch(&(*root)->left_son_ptr, Storage, l, mid-1, false);
+        if (rebuild_flag) Log_Batch_Points(Storage, l, mid-1, DELETE_POINT);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if (!in_background_rebuild((*root)->right_son_ptr)){
+        tmp_counter += Delete_by_batch(&(*root)->right_son_ptr, Storage, mid, r, allow_rebuild);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_by_batch(&(*root)->right_son_ptr, Storage, mid, r, false);
+        if (rebuild_flag) Log_Batch_Points(Storage, mid, r, DELETE_POINT);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    Update(*root);
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild) Rebuild(root);
+    if ((*root) != nullptr) (*root)->working_flag = false;   
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild){
     if ((*root) == nullptr) return;
     (*root)->working_flag = true;
     Push_Down(*root);       
@@ -782,7 +3072,7 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoin
     struct timespec Timeout;    
     add_box_log.op = ADD_BOX;
     add_box_log.boxpoint = boxpoint;
-    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){
+    if (!in_background_rebuild((*root)->left_son_ptr)){
         Add_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild);
     } else {
         pthread_mutex_lock(&working_flag_mutex);
@@ -794,7 +3084,7 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoin
         }        
         pthread_mutex_unlock(&working_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){
+    if (!in_background_rebuild((*root)->right_son_ptr)){
         Add_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild);
     } else {
         pthread_mutex_lock(&working_flag_mutex);
@@ -807,15 +3097,15 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoin
         pthread_mutex_unlock(&working_flag_mutex);
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num) Rebuild_Ptr = nullptr; 
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild) Rebuild(root);
     if ((*root) != nullptr) (*root)->working_flag = false;   
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild, int father_axis){     
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild, int father_axis){     
     if (*root == nullptr){
         *root = new KD_TREE_NODE;
         InitTreeNode(*root);
@@ -831,7 +3121,7 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE ** root, PointType point, boo
     add_log.point = point;
     Push_Down(*root);
     if (((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z)){
-        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){          
+        if (!in_background_rebuild((*root)->left_son_ptr)){          
             Add_by_point(&(*root)->left_son_ptr, point, allow_rebuild, (*root)->division_axis);
         } else {
             pthread_mutex_lock(&working_flag_mutex);
@@ -844,7 +3134,7 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE ** root, PointType point, boo
             pthread_mutex_unlock(&working_flag_mutex);            
         }
     } else {  
-        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){         
+        if (!in_background_rebuild((*root)->right_son_ptr)){         
             Add_by_point(&(*root)->right_son_ptr, point, allow_rebuild,(*root)->division_axis);
         } else {
             pthread_mutex_lock(&working_flag_mutex);
@@ -857,32 +3147,81 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE ** root, PointType point, boo
             pthread_mutex_unlock(&working_flag_mutex); 
         }
     }
-    Update(*root);   
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num) Rebuild_Ptr = nullptr; 
+    Update(*root);   
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild) Rebuild(root); 
+    if ((*root) != nullptr) (*root)->working_flag = false;   
+    return;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Add_by_batch(KD_TREE_NODE ** root, PointVector & Storage, int l, int r, bool allow_rebuild){
+    if (l > r) return;
+    if (*root == nullptr){
+        // Points falling into an empty branch become a balanced subtree at once
+        BuildTree(root, l, r, Storage);
+        return;
+    }
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int axis = (*root)->division_axis;
+    PointType split_point = (*root)->point;
+    int mid = partition(begin(Storage)+l, begin(Storage)+r+1, [axis, &split_point](const PointType & p){
+        return (axis == 0 && p.x < split_point.x) || (axis == 1 && p.y < split_point.y) || (axis == 2 && p.z < split_point.z);
+    }) - begin(Storage);
+    if (!in_background_rebuild((*root)->left_son_ptr)){
+        Add_by_batch(&(*root)->left_son_ptr, Storage, l, mid-1, allow_rebuild);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        Add_by_batch(&(*root)->left_son_ptr, Storage, l, mid-1, false);
+        if (rebuild_flag) Log_Batch_Points(Storage, l, mid-1, ADD_POINT);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if (!in_background_rebuild((*root)->right_son_ptr)){
+        Add_by_batch(&(*root)->right_son_ptr, Storage, mid, r, allow_rebuild);
+    } else {
+        pthread_mutex_lock(&working_flag_mutex);
+        Add_by_batch(&(*root)->right_son_ptr, Storage, mid, r, false);
+        if (rebuild_flag) Log_Batch_Points(Storage, mid, r, ADD_POINT);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    Update(*root);
+    if (in_background_rebuild(*root) && (*root)->TreeSize < multi_thread_rebuild_point_num) Rebuild_Ptr = nullptr; 
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild) Rebuild(root); 
     if ((*root) != nullptr) (*root)->working_flag = false;   
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist){
-    if (root == nullptr || root->tree_deleted) return;   
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Log_Batch_Points(PointVector & Storage, int l, int r, operation_set op){
+    Operation_Logger_Type point_log;
+    point_log.op = op;
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    for (int i = l; i <= r; i++){
+        point_log.point = Storage[i];
+        Rebuild_Logger.push(point_log);
+    }
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist, Lazy_Tag_Type tag, const Time_Window_Type * window){
+    if (root == nullptr) return;
+    bool point_deleted, point_downsample_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    if (Resolve_Lazy_Tag(root, tag, point_deleted, point_downsample_deleted, left_tag, right_tag)) return;
+    q.visit_num ++;
+    if (window != nullptr){
+        if (root->time_max < window->time_min || root->time_min > window->time_max) return;
+        double point_time = Point_Timestamp(root->point);
+        if (point_time < window->time_min || point_time > window->time_max) point_deleted = true;
+    }
     double cur_dist = calc_box_dist(root, point);
     double max_dist_sqr = max_dist * max_dist;
     if (cur_dist > max_dist_sqr) return;    
-    int retval; 
-    if (root->need_push_down_to_left || root->need_push_down_to_right) {
-        retval = pthread_mutex_trylock(&(root->push_down_mutex_lock));
-        if (retval == 0){
-            Push_Down(root);
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        } else {
-            pthread_mutex_lock(&(root->push_down_mutex_lock));
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
-    }
-    if (!root->point_deleted){
+    if (!point_deleted){
         float dist = calc_dist(point, root->point);
         if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist)){
             if (q.size() >= k_nearest) q.pop();
@@ -895,8 +3234,8 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
     float dist_right_node = calc_box_dist(root->right_son_ptr, point);
     if (q.size()< k_nearest || dist_left_node < q.top().dist && dist_right_node < q.top().dist){
         if (dist_left_node <= dist_right_node) {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);                       
+            if (!in_background_rebuild(root->left_son_ptr)){
+                Search(root->left_son_ptr, k_nearest, point, q, max_dist, left_tag, window);                       
             } else {
                 pthread_mutex_lock(&search_flag_mutex);
                 while (search_mutex_counter == -1)
@@ -907,14 +3246,14 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
                 }
                 search_mutex_counter += 1;
                 pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);  
+                Search(root->left_son_ptr, k_nearest, point, q, max_dist, left_tag, window);  
                 pthread_mutex_lock(&search_flag_mutex);
                 search_mutex_counter -= 1;
                 pthread_mutex_unlock(&search_flag_mutex);
             }
             if (q.size() < k_nearest || dist_right_node < q.top().dist) {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);                       
+                if (!in_background_rebuild(root->right_son_ptr)){
+                    Search(root->right_son_ptr, k_nearest, point, q, max_dist, right_tag, window);                       
                 } else {
                     pthread_mutex_lock(&search_flag_mutex);
                     while (search_mutex_counter == -1)
@@ -925,15 +3264,15 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
                     }
                     search_mutex_counter += 1;
                     pthread_mutex_unlock(&search_flag_mutex);                    
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);  
+                    Search(root->right_son_ptr, k_nearest, point, q, max_dist, right_tag, window);  
                     pthread_mutex_lock(&search_flag_mutex);
                     search_mutex_counter -= 1;
                     pthread_mutex_unlock(&search_flag_mutex);
                 }                
             }
         } else {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);                       
+            if (!in_background_rebuild(root->right_son_ptr)){
+                Search(root->right_son_ptr, k_nearest, point, q, max_dist, right_tag, window);                       
             } else {
                 pthread_mutex_lock(&search_flag_mutex);
                 while (search_mutex_counter == -1)
@@ -944,14 +3283,14 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
                 }
                 search_mutex_counter += 1;
                 pthread_mutex_unlock(&search_flag_mutex);                   
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);  
+                Search(root->right_son_ptr, k_nearest, point, q, max_dist, right_tag, window);  
                 pthread_mutex_lock(&search_flag_mutex);
                 search_mutex_counter -= 1;
                 pthread_mutex_unlock(&search_flag_mutex);
             }
             if (q.size() < k_nearest || dist_left_node < q.top().dist) {            
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);                       
+                if (!in_background_rebuild(root->left_son_ptr)){
+                    Search(root->left_son_ptr, k_nearest, point, q, max_dist, left_tag, window);                       
                 } else {
                     pthread_mutex_lock(&search_flag_mutex);
                     while (search_mutex_counter == -1)
@@ -962,7 +3301,7 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
                     }
                     search_mutex_counter += 1;
                     pthread_mutex_unlock(&search_flag_mutex);  
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);  
+                    Search(root->left_son_ptr, k_nearest, point, q, max_dist, left_tag, window);  
                     pthread_mutex_lock(&search_flag_mutex);
                     search_mutex_counter -= 1;
                     pthread_mutex_unlock(&search_flag_mutex);
@@ -971,8 +3310,8 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
         }
     } else {
         if (dist_left_node < q.top().dist) {        
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);                       
+            if (!in_background_rebuild(root->left_son_ptr)){
+                Search(root->left_son_ptr, k_nearest, point, q, max_dist, left_tag, window);                       
             } else {
                 pthread_mutex_lock(&search_flag_mutex);
                 while (search_mutex_counter == -1)
@@ -983,15 +3322,15 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
                 }
                 search_mutex_counter += 1;
                 pthread_mutex_unlock(&search_flag_mutex);  
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);  
+                Search(root->left_son_ptr, k_nearest, point, q, max_dist, left_tag, window);  
                 pthread_mutex_lock(&search_flag_mutex);
                 search_mutex_counter -= 1;
                 pthread_mutex_unlock(&search_flag_mutex);
             }
         }
         if (dist_right_node < q.top().dist) {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);                       
+            if (!in_background_rebuild(root->right_son_ptr)){
+                Search(root->right_son_ptr, k_nearest, point, q, max_dist, right_tag, window);                       
             } else {
                 pthread_mutex_lock(&search_flag_mutex);
                 while (search_mutex_counter == -1)
@@ -1002,7 +3341,7 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
                 }
                 search_mutex_counter += 1;
                 pthread_mutex_unlock(&search_flag_mutex);  
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
+                Search(root->right_son_ptr, k_nearest, point, q, max_dist, right_tag, window);
                 pthread_mutex_lock(&search_flag_mutex);
                 search_mutex_counter -= 1;
                 pthread_mutex_unlock(&search_flag_mutex);
@@ -1012,43 +3351,48 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE * root, int k_nearest, PointType po
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector & Storage){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector & Storage, Lazy_Tag_Type tag){
     if (root == nullptr) return;
-    Push_Down(root);       
+    bool point_deleted, point_downsample_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    if (Resolve_Lazy_Tag(root, tag, point_deleted, point_downsample_deleted, left_tag, right_tag)) return;
     if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1]) return;
     if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1]) return;
     if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1]) return;
     if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1]){
-        flatten(root, Storage, NOT_RECORD);
+        flatten(root, Storage, NOT_RECORD, tag);
         return;
     }
     if (boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z){
-        if (!root->point_deleted) Storage.push_back(root->point);
+        if (!point_deleted) Storage.push_back(root->point);
     }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr){
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
+    if (!in_background_rebuild(root->left_son_ptr)){
+        Search_by_range(root->left_son_ptr, boxpoint, Storage, left_tag);
     } else {
         pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
+        Search_by_range(root->left_son_ptr, boxpoint, Storage, left_tag);
         pthread_mutex_unlock(&search_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr){
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
+    if (!in_background_rebuild(root->right_son_ptr)){
+        Search_by_range(root->right_son_ptr, boxpoint, Storage, right_tag);
     } else {
         pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
+        Search_by_range(root->right_son_ptr, boxpoint, Storage, right_tag);
         pthread_mutex_unlock(&search_flag_mutex);
     }
     return;    
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage)
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage, Lazy_Tag_Type tag)
 {
     if (root == nullptr)
         return;
-    Push_Down(root);
+    bool point_deleted, point_downsample_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    if (Resolve_Lazy_Tag(root, tag, point_deleted, point_downsample_deleted, left_tag, right_tag))
+        return;
     PointType range_center;
     range_center.x = (root->node_range_x[0] + root->node_range_x[1]) * 0.5;
     range_center.y = (root->node_range_y[0] + root->node_range_y[1]) * 0.5;
@@ -1057,38 +3401,38 @@ void KD_TREE<PointType>::Search_by_radius(KD_TREE_NODE *root, PointType point, f
     if (dist > radius + sqrt(root->radius_sq)) return;
     if (dist <= radius - sqrt(root->radius_sq)) 
     {
-        flatten(root, Storage, NOT_RECORD);
+        flatten(root, Storage, NOT_RECORD, tag);
         return;
     }
-    if (!root->point_deleted && calc_dist(root->point, point) <= radius * radius){
+    if (!point_deleted && calc_dist(root->point, point) <= radius * radius){
         Storage.push_back(root->point);
     }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr)
+    if (!in_background_rebuild(root->left_son_ptr))
     {
-        Search_by_radius(root->left_son_ptr, point, radius, Storage);
+        Search_by_radius(root->left_son_ptr, point, radius, Storage, left_tag);
     }
     else
     {
         pthread_mutex_lock(&search_flag_mutex);
-        Search_by_radius(root->left_son_ptr, point, radius, Storage);
+        Search_by_radius(root->left_son_ptr, point, radius, Storage, left_tag);
         pthread_mutex_unlock(&search_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr)
+    if (!in_background_rebuild(root->right_son_ptr))
     {
-        Search_by_radius(root->right_son_ptr, point, radius, Storage);
+        Search_by_radius(root->right_son_ptr, point, radius, Storage, right_tag);
     }
     else
     {
         pthread_mutex_lock(&search_flag_mutex);
-        Search_by_radius(root->right_son_ptr, point, radius, Storage);
+        Search_by_radius(root->right_son_ptr, point, radius, Storage, right_tag);
         pthread_mutex_unlock(&search_flag_mutex);
     }    
     return;
 }
 
-template <typename PointType>
-bool KD_TREE<PointType>::Criterion_Check(KD_TREE_NODE * root){
-    if (root->TreeSize <= Minimal_Unbalanced_Tree_Size){
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Criterion_Check(KD_TREE_NODE * root){
+    if (root->TreeSize <= minimal_unbalanced_tree_size){
         return false;
     }
     float balance_evaluation = 0.0f;
@@ -1098,23 +3442,40 @@ bool KD_TREE<PointType>::Criterion_Check(KD_TREE_NODE * root){
     delete_evaluation = float(root->invalid_point_num)/ root->TreeSize;
     balance_evaluation = float(son_ptr->TreeSize) / (root->TreeSize-1);  
     if (delete_evaluation > delete_criterion_param){
-        return true;
+        return !Adaptive_Rebuild || Rebuild_Pays_Off(root, delete_evaluation, balance_evaluation);
     }
     if (balance_evaluation > balance_criterion_param || balance_evaluation < 1-balance_criterion_param){
-        return true;
+        return !Adaptive_Rebuild || Rebuild_Pays_Off(root, delete_evaluation, balance_evaluation);
     } 
     return false;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root){
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Rebuild_Pays_Off(KD_TREE_NODE * root, float delete_evaluation, float balance_evaluation){
+    long long rebuild_points = Rebuild_Point_Total, query_levels = Query_Level_Total, updates = Update_Num;
+    // Nothing measured yet, trust the fixed thresholds
+    if (rebuild_points == 0 || query_levels == 0 || updates == 0) return true;
+    double rebuild_cost = double(Rebuild_Time_Total) / rebuild_points;
+    double level_cost = double(Query_Time_Total) / query_levels;
+    double traversals = double(Query_Num + updates) / updates;
+    // Expected traversal depth of the subtree now and after a rebuild, deleted nodes are still walked through
+    double alpha = min(max(double(balance_evaluation), 1.0 - balance_evaluation), 0.99);
+    double valid_ratio = max(1.0 - delete_evaluation, 0.01);
+    double depth_now = log(double(root->TreeSize)) / -log(alpha) / valid_ratio;
+    double depth_rebuilt = log2(max(root->TreeSize * valid_ratio, 2.0));
+    // A rebuilt subtree serves about TreeSize updates before degrading again, so savings and cost are both compared per point
+    return traversals * (depth_now - depth_rebuilt) * level_cost > rebuild_cost;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Push_Down(KD_TREE_NODE *root){
     if (root == nullptr) return;
     Operation_Logger_Type operation;
     operation.op = PUSH_DOWN;
     operation.tree_deleted = root->tree_deleted;
     operation.tree_downsample_deleted = root->tree_downsample_deleted;
     if (root->need_push_down_to_left && root->left_son_ptr != nullptr){
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
+        if (!in_background_rebuild(root->left_son_ptr)){
             root->left_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->tree_deleted = root->tree_deleted || root->left_son_ptr->tree_downsample_deleted;
@@ -1146,7 +3507,7 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root){
         }
     }
     if (root->need_push_down_to_right && root->right_son_ptr != nullptr){
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
+        if (!in_background_rebuild(root->right_son_ptr)){
             root->right_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->tree_deleted = root->tree_deleted || root->right_son_ptr->tree_downsample_deleted;
@@ -1180,8 +3541,35 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root){
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::Update(KD_TREE_NODE * root){
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::Resolve_Lazy_Tag(KD_TREE_NODE * root, const Lazy_Tag_Type & tag, bool & point_deleted, bool & point_downsample_deleted, Lazy_Tag_Type & left_tag, Lazy_Tag_Type & right_tag){
+    // Same flag arithmetic as Push_Down, but the result is only carried down the traversal and never written to the node.
+    bool tree_deleted = root->tree_deleted;
+    bool tree_downsample_deleted = root->tree_downsample_deleted;
+    point_deleted = root->point_deleted;
+    point_downsample_deleted = root->point_downsample_deleted;
+    if (tag.pushed){
+        tree_downsample_deleted |= tag.tree_downsample_deleted;
+        point_downsample_deleted |= tag.tree_downsample_deleted;
+        tree_deleted = tag.tree_deleted || tree_downsample_deleted;
+        point_deleted = tree_deleted || point_downsample_deleted;
+    }
+    left_tag.pushed = tag.pushed || root->need_push_down_to_left;
+    left_tag.tree_deleted = tree_deleted;
+    left_tag.tree_downsample_deleted = tree_downsample_deleted;
+    right_tag.pushed = tag.pushed || root->need_push_down_to_right;
+    right_tag.tree_deleted = tree_deleted;
+    right_tag.tree_downsample_deleted = tree_downsample_deleted;
+    return tree_deleted;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::in_background_rebuild(KD_TREE_NODE * root){
+    return ThreadPolicy::Multi_Thread && Rebuild_Ptr != nullptr && *Rebuild_Ptr == root;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Update(KD_TREE_NODE * root){
     KD_TREE_NODE * left_son_ptr = root->left_son_ptr;
     KD_TREE_NODE * right_son_ptr = root->right_son_ptr;
     float tmp_range_x[2] = {INFINITY, -INFINITY};
@@ -1303,6 +3691,8 @@ void KD_TREE<PointType>::Update(KD_TREE_NODE * root){
         tmp_range_z[0] = root->point.z;
         tmp_range_z[1] = root->point.z;                 
     }
+    root->tree_rebuild_pending = root->rebuild_pending || (left_son_ptr != nullptr && left_son_ptr->tree_rebuild_pending) || (right_son_ptr != nullptr && right_son_ptr->tree_rebuild_pending);
+    if (Point_Timestamp) Update_Time_Range(root);
     memcpy(root->node_range_x,tmp_range_x,sizeof(tmp_range_x));
     memcpy(root->node_range_y,tmp_range_y,sizeof(tmp_range_y));
     memcpy(root->node_range_z,tmp_range_z,sizeof(tmp_range_z));
@@ -1322,26 +3712,55 @@ void KD_TREE<PointType>::Update(KD_TREE_NODE * root){
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type){
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Update_Time_Range(KD_TREE_NODE * root){
+    root->time_min = Point_Timestamp(root->point);
+    root->time_max = root->time_min;
+    if (root->left_son_ptr != nullptr){
+        root->time_min = min(root->time_min, root->left_son_ptr->time_min);
+        root->time_max = max(root->time_max, root->left_son_ptr->time_max);
+    }
+    if (root->right_son_ptr != nullptr){
+        root->time_min = min(root->time_min, root->right_son_ptr->time_min);
+        root->time_max = max(root->time_max, root->right_son_ptr->time_max);
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Rebuild_Time_Range(KD_TREE_NODE * root){
+    if (root == nullptr) return;
+    Rebuild_Time_Range(root->left_son_ptr);
+    Rebuild_Time_Range(root->right_son_ptr);
+    Update_Time_Range(root);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type){
+    flatten(root, Storage, storage_type, Lazy_Tag_Type());
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type, Lazy_Tag_Type tag){
     if (root == nullptr) return;
-    Push_Down(root);
-    if (!root->point_deleted) {
+    bool point_deleted, point_downsample_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(root, tag, point_deleted, point_downsample_deleted, left_tag, right_tag);
+    if (!point_deleted) {
         Storage.push_back(root->point);
     }
-    flatten(root->left_son_ptr, Storage, storage_type);
-    flatten(root->right_son_ptr, Storage, storage_type);
+    flatten(root->left_son_ptr, Storage, storage_type, left_tag);
+    flatten(root->right_son_ptr, Storage, storage_type, right_tag);
     switch (storage_type)
     {
     case NOT_RECORD:
         break;
     case DELETE_POINTS_REC:
-        if (root->point_deleted && !root->point_downsample_deleted) {
+        if (point_deleted && !point_downsample_deleted) {
             Points_deleted.push_back(root->point);
         }       
         break;
     case MULTI_THREAD_REC:
-        if (root->point_deleted  && !root->point_downsample_deleted) {
+        if (point_deleted  && !point_downsample_deleted) {
             Multithread_Points_deleted.push_back(root->point);
         }
         break;
@@ -1351,34 +3770,76 @@ void KD_TREE<PointType>::flatten(KD_TREE_NODE * root, PointVector &Storage, dele
     return;
 }
 
-template <typename PointType>
-void KD_TREE<PointType>::delete_tree_nodes(KD_TREE_NODE ** root){ 
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::delete_tree_nodes(KD_TREE_NODE ** root){ 
     if (*root == nullptr) return;
     Push_Down(*root);    
     delete_tree_nodes(&(*root)->left_son_ptr);
     delete_tree_nodes(&(*root)->right_son_ptr);
     
-    pthread_mutex_destroy( &(*root)->push_down_mutex_lock);         
     delete *root;
     *root = nullptr;                    
 
     return;
 }
 
-template <typename PointType>
-bool KD_TREE<PointType>::same_point(PointType a, PointType b){
+template <typename PointType, typename ThreadPolicy>
+typename KD_TREE<PointType, ThreadPolicy>::KD_TREE_NODE * KD_TREE<PointType, ThreadPolicy>::new_tree_node(vector<KD_TREE_NODE *> * node_pool){
+    if (node_pool == nullptr || node_pool->empty()) return new KD_TREE_NODE;
+    KD_TREE_NODE * node = node_pool->back();
+    node_pool->pop_back();
+    *node = KD_TREE_NODE();
+    return node;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::recycle_tree_nodes(KD_TREE_NODE ** root, vector<KD_TREE_NODE *> & node_pool){
+    if (*root == nullptr) return;
+    recycle_tree_nodes(&(*root)->left_son_ptr, node_pool);
+    recycle_tree_nodes(&(*root)->right_son_ptr, node_pool);
+    node_pool.push_back(*root);
+    *root = nullptr;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::release_node_pool(vector<KD_TREE_NODE *> & node_pool, int keep_num){
+    while (node_pool.size() > keep_num){
+        delete node_pool.back();
+        node_pool.pop_back();
+    }
+    if (keep_num == 0) vector<KD_TREE_NODE *> ().swap(node_pool);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void KD_TREE<PointType, ThreadPolicy>::Discard_Tree(){
+    // The current tree is replaced, wait for a background rebuild still working on it
+    if (ThreadPolicy::Multi_Thread){
+        pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+        while (Rebuild_Ptr != nullptr){
+            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+            usleep(1);
+            pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+        }
+        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    }
+    if (Root_Node != nullptr) recycle_tree_nodes(&Root_Node, Node_Pool);
+    if (STATIC_ROOT_NODE != nullptr) STATIC_ROOT_NODE->left_son_ptr = nullptr;
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool KD_TREE<PointType, ThreadPolicy>::same_point(PointType a, PointType b){
     return (fabs(a.x-b.x) < EPSS && fabs(a.y-b.y) < EPSS && fabs(a.z-b.z) < EPSS );
 }
 
-template <typename PointType>
-float KD_TREE<PointType>::calc_dist(PointType a, PointType b){
+template <typename PointType, typename ThreadPolicy>
+float KD_TREE<PointType, ThreadPolicy>::calc_dist(PointType a, PointType b){
     float dist = 0.0f;
     dist = (a.x-b.x)*(a.x-b.x) + (a.y-b.y)*(a.y-b.y) + (a.z-b.z)*(a.z-b.z);
     return dist;
 }
 
-template <typename PointType>
-float KD_TREE<PointType>::calc_box_dist(KD_TREE_NODE * node, PointType point){
+template <typename PointType, typename ThreadPolicy>
+float KD_TREE<PointType, ThreadPolicy>::calc_box_dist(KD_TREE_NODE * node, PointType point){
     if (node == nullptr) return INFINITY;
     float min_dist = 0.0;
     if (point.x < node->node_range_x[0]) min_dist += (point.x - node->node_range_x[0])*(point.x - node->node_range_x[0]);
@@ -1390,13 +3851,10 @@ float KD_TREE<PointType>::calc_box_dist(KD_TREE_NODE * node, PointType point){
     return min_dist;
 }
 
-template <typename PointType> bool KD_TREE<PointType>::point_cmp_x(PointType a, PointType b) { return a.x < b.x;}
-template <typename PointType> bool KD_TREE<PointType>::point_cmp_y(PointType a, PointType b) { return a.y < b.y;}
-template <typename PointType> bool KD_TREE<PointType>::point_cmp_z(PointType a, PointType b) { return a.z < b.z;}
 
 // manual queue
-template <typename T>
-void MANUAL_Q<T>::clear(){
+template <typename T, int Q_Capacity>
+void MANUAL_Q<T, Q_Capacity>::clear(){
     head = 0;
     tail = 0;
     counter = 0;
@@ -1404,46 +3862,668 @@ void MANUAL_Q<T>::clear(){
     return;
 }
 
-template <typename T>
-void MANUAL_Q<T>::pop(){
+template <typename T, int Q_Capacity>
+void MANUAL_Q<T, Q_Capacity>::pop(){
     if (counter == 0) return;
     head ++;
-    head %= Q_LEN;
+    head %= Q_Capacity;
     counter --;
     if (counter == 0) is_empty = true;
     return;
 }
 
-template <typename T>
-T MANUAL_Q<T>::front(){
+template <typename T, int Q_Capacity>
+T MANUAL_Q<T, Q_Capacity>::front(){
     return q[head];
 }
 
-template <typename T>
-T MANUAL_Q<T>::back(){
+template <typename T, int Q_Capacity>
+T MANUAL_Q<T, Q_Capacity>::back(){
     return q[tail];
 }
 
-template <typename T>
-void MANUAL_Q<T>::push(T op){
+template <typename T, int Q_Capacity>
+void MANUAL_Q<T, Q_Capacity>::push(T op){
     q[tail] = op;
     counter ++;
     if (is_empty) is_empty = false;
     tail ++;
-    tail %= Q_LEN;
+    tail %= Q_Capacity;
 }
 
-template <typename T>
-bool MANUAL_Q<T>::empty(){
+template <typename T, int Q_Capacity>
+bool MANUAL_Q<T, Q_Capacity>::empty(){
     return is_empty;
 }
 
-template <typename T>
-int MANUAL_Q<T>::size(){
+template <typename T, int Q_Capacity>
+int MANUAL_Q<T, Q_Capacity>::size(){
     return counter;
 }
 
+template <typename PointType>
+STATIC_KD_TREE<PointType>::~STATIC_KD_TREE(){
+    close();
+}
+
+template <typename PointType>
+bool STATIC_KD_TREE<PointType>::open(const string & path){
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < sizeof(Static_Tree_Header_Type)){
+        ::close(fd);
+        return false;
+    }
+    void * data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) return false;
+    const Static_Tree_Header_Type * header = static_cast<const Static_Tree_Header_Type *>(data);
+    if (memcmp(header->magic, "IKDS", 4) != 0 || header->version != Static_Tree_File_Version || header->point_size != sizeof(PointType)
+        || header->node_size != sizeof(Node_Type) || header->node_num < 0 || header->node_num > INT_MAX
+        || sizeof(Static_Tree_Header_Type) + header->node_num * sizeof(Node_Type) > file_stat.st_size){
+        munmap(data, file_stat.st_size);
+        return false;
+    }
+    Mapped_Data = data;
+    Mapped_Size = file_stat.st_size;
+    Nodes = reinterpret_cast<const Node_Type *>(static_cast<const char *>(data) + sizeof(Static_Tree_Header_Type));
+    Node_Num = header->node_num;
+    if (!Check_Nodes()){
+        close();
+        return false;
+    }
+    return true;
+}
+
+template <typename PointType>
+bool STATIC_KD_TREE<PointType>::Check_Nodes(){
+    // The searches trust tree_size and left_size as offsets, so every subtree must be a run of records inside its father's run
+    if (Node_Num > 0 && Nodes[0].tree_size != Node_Num) return false;
+    for (int i = 0; i < Node_Num; i++){
+        const Node_Type & node = Nodes[i];
+        if (node.tree_size < 1 || node.tree_size > Node_Num - i || node.left_size < 0 || node.left_size >= node.tree_size) return false;
+        int right_size = node.tree_size - 1 - node.left_size;
+        if (node.left_size > 0 && Nodes[i + 1].tree_size != node.left_size) return false;
+        if (right_size > 0 && Nodes[i + 1 + node.left_size].tree_size != right_size) return false;
+    }
+    return true;
+}
+
+template <typename PointType>
+void STATIC_KD_TREE<PointType>::close(){
+    if (Mapped_Data != nullptr) munmap(Mapped_Data, Mapped_Size);
+    Mapped_Data = nullptr;
+    Mapped_Size = 0;
+    Nodes = nullptr;
+    Node_Num = 0;
+}
+
+template <typename PointType>
+int STATIC_KD_TREE<PointType>::size(){
+    return Node_Num;
+}
+
+template <typename PointType>
+BoxPointType STATIC_KD_TREE<PointType>::tree_range(){
+    BoxPointType range;
+    memset(&range, 0, sizeof(range));
+    if (Node_Num == 0) return range;
+    for (int k = 0; k < 3; k++){
+        range.vertex_min[k] = Nodes[0].node_range[2*k];
+        range.vertex_max[k] = Nodes[0].node_range[2*k+1];
+    }
+    return range;
+}
+
+template <typename PointType>
+void STATIC_KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVector& Nearest_Points, vector<float> & Point_Distance, double max_dist){
+    MANUAL_HEAP q(2*k_nearest);
+    q.clear();
+    if (Node_Num > 0) Search(0, k_nearest, point, q, max_dist);
+    int k_found = min(k_nearest,int(q.size()));
+    PointVector ().swap(Nearest_Points);
+    vector<float> ().swap(Point_Distance);
+    for (int i=0;i < k_found;i++){
+        Nearest_Points.insert(Nearest_Points.begin(), q.top().point);
+        Point_Distance.insert(Point_Distance.begin(), q.top().dist);
+        q.pop();
+    }
+}
+
+template <typename PointType>
+void STATIC_KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage){
+    Storage.clear();
+    if (Node_Num > 0) Search_by_range(0, Box_of_Point, Storage);
+}
+
+template <typename PointType>
+void STATIC_KD_TREE<PointType>::Radius_Search(PointType point, const float radius, PointVector &Storage){
+    Storage.clear();
+    if (Node_Num > 0) Search_by_radius(0, point, radius, Storage);
+}
+
+template <typename PointType>
+void STATIC_KD_TREE<PointType>::Search(int index, int k_nearest, const PointType & point, MANUAL_HEAP &q, double max_dist){
+    const Node_Type & node = Nodes[index];
+    double max_dist_sqr = max_dist * max_dist;
+    if (calc_box_dist(index, point) > max_dist_sqr) return;
+    float dist = (node.point.x-point.x)*(node.point.x-point.x) + (node.point.y-point.y)*(node.point.y-point.y) + (node.point.z-point.z)*(node.point.z-point.z);
+    if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist)){
+        if (q.size() >= k_nearest) q.pop();
+        q.push(typename KD_TREE<PointType>::PointType_CMP(node.point, dist));
+    }
+    int left_index = node.left_size > 0 ? index + 1 : -1;
+    int right_index = node.tree_size - 1 > node.left_size ? index + 1 + node.left_size : -1;
+    float dist_left_node = left_index >= 0 ? calc_box_dist(left_index, point) : INFINITY;
+    float dist_right_node = right_index >= 0 ? calc_box_dist(right_index, point) : INFINITY;
+    // Visit the nearer son first, the farther one only if it can still improve the heap
+    if (dist_left_node > dist_right_node){
+        swap(left_index, right_index);
+        swap(dist_left_node, dist_right_node);
+    }
+    if (left_index >= 0 && (q.size() < k_nearest || dist_left_node < q.top().dist)) Search(left_index, k_nearest, point, q, max_dist);
+    if (right_index >= 0 && (q.size() < k_nearest || dist_right_node < q.top().dist)) Search(right_index, k_nearest, point, q, max_dist);
+}
+
+template <typename PointType>
+void STATIC_KD_TREE<PointType>::Search_by_range(int index, const BoxPointType & boxpoint, PointVector &Storage){
+    const Node_Type & node = Nodes[index];
+    if (boxpoint.vertex_max[0] <= node.node_range[0] || boxpoint.vertex_min[0] > node.node_range[1]) return;
+    if (boxpoint.vertex_max[1] <= node.node_range[2] || boxpoint.vertex_min[1] > node.node_range[3]) return;
+    if (boxpoint.vertex_max[2] <= node.node_range[4] || boxpoint.vertex_min[2] > node.node_range[5]) return;
+    if (boxpoint.vertex_min[0] <= node.node_range[0] && boxpoint.vertex_max[0] > node.node_range[1] && boxpoint.vertex_min[1] <= node.node_range[2] && boxpoint.vertex_max[1] > node.node_range[3] && boxpoint.vertex_min[2] <= node.node_range[4] && boxpoint.vertex_max[2] > node.node_range[5]){
+        flatten(index, Storage);
+        return;
+    }
+    if (boxpoint.vertex_min[0] <= node.point.x && boxpoint.vertex_max[0] > node.point.x && boxpoint.vertex_min[1] <= node.point.y && boxpoint.vertex_max[1] > node.point.y && boxpoint.vertex_min[2] <= node.point.z && boxpoint.vertex_max[2] > node.point.z){
+        Storage.push_back(node.point);
+    }
+    if (node.left_size > 0) Search_by_range(index + 1, boxpoint, Storage);
+    if (node.tree_size - 1 > node.left_size) Search_by_range(index + 1 + node.left_size, boxpoint, Storage);
+}
+
+template <typename PointType>
+void STATIC_KD_TREE<PointType>::Search_by_radius(int index, const PointType & point, float radius, PointVector &Storage){
+    const Node_Type & node = Nodes[index];
+    float center[3], radius_sq = 0.0f, dist = 0.0f;
+    for (int k = 0; k < 3; k++){
+        float half_length = (node.node_range[2*k+1] - node.node_range[2*k]) * 0.5f;
+        center[k] = (node.node_range[2*k] + node.node_range[2*k+1]) * 0.5f;
+        radius_sq += half_length * half_length;
+    }
+    dist = sqrt((center[0]-point.x)*(center[0]-point.x) + (center[1]-point.y)*(center[1]-point.y) + (center[2]-point.z)*(center[2]-point.z));
+    if (dist > radius + sqrt(radius_sq)) return;
+    if (dist <= radius - sqrt(radius_sq)){
+        flatten(index, Storage);
+        return;
+    }
+    if ((node.point.x-point.x)*(node.point.x-point.x) + (node.point.y-point.y)*(node.point.y-point.y) + (node.point.z-point.z)*(node.point.z-point.z) <= radius * radius){
+        Storage.push_back(node.point);
+    }
+    if (node.left_size > 0) Search_by_radius(index + 1, point, radius, Storage);
+    if (node.tree_size - 1 > node.left_size) Search_by_radius(index + 1 + node.left_size, point, radius, Storage);
+}
+
+template <typename PointType>
+void STATIC_KD_TREE<PointType>::flatten(int index, PointVector &Storage){
+    // A subtree is a run of consecutive records
+    for (int i = index; i < index + Nodes[index].tree_size; i++) Storage.push_back(Nodes[i].point);
+}
+
+template <typename PointType>
+float STATIC_KD_TREE<PointType>::calc_box_dist(int index, const PointType & point){
+    const float * range = Nodes[index].node_range;
+    float min_dist = 0.0;
+    if (point.x < range[0]) min_dist += (point.x - range[0])*(point.x - range[0]);
+    if (point.x > range[1]) min_dist += (point.x - range[1])*(point.x - range[1]);
+    if (point.y < range[2]) min_dist += (point.y - range[2])*(point.y - range[2]);
+    if (point.y > range[3]) min_dist += (point.y - range[3])*(point.y - range[3]);
+    if (point.z < range[4]) min_dist += (point.z - range[4])*(point.z - range[4]);
+    if (point.z > range[5]) min_dist += (point.z - range[5])*(point.z - range[5]);
+    return min_dist;
+}
+
+template <typename PointType, typename ThreadPolicy>
+TILED_KD_TREE<PointType, ThreadPolicy>::TILED_KD_TREE(const string & directory, float tile_size, float prefetch_radius, float delete_param, float balance_param, float box_length, RebuildPolicyType rebuild_policy){
+    Directory = directory;
+    Tile_Size = tile_size;
+    Prefetch_Radius = prefetch_radius;
+    Delete_Param = delete_param;
+    Balance_Param = balance_param;
+    Box_Length = box_length;
+    Rebuild_Policy = rebuild_policy;
+    mkdir(Directory.c_str(), 0755);
+    // Tiles saved by an earlier run over the same directory and tile size are known but left on disk
+    DIR * dir = opendir(Directory.c_str());
+    if (dir != nullptr){
+        struct dirent * entry;
+        while ((entry = readdir(dir)) != nullptr){
+            Tile_Key_Type key;
+            int name_length = 0;
+            if (sscanf(entry->d_name, "tile_%d_%d.ikd%n", &key.x, &key.y, &name_length) == 2 && entry->d_name[name_length] == '\0'){
+                Tiles[key].on_disk = true;
+            }
+        }
+        closedir(dir);
+    } else {
+        printf("Tiled map directory %s is not accessible, tiles will not be paged out\n", Directory.c_str());
+    }
+    pthread_mutex_init(&tile_mutex, NULL);
+    pthread_cond_init(&tile_cond, NULL);
+    pthread_create(&paging_thread, NULL, paging_thread_ptr, (void*) this);
+}
+
+template <typename PointType, typename ThreadPolicy>
+TILED_KD_TREE<PointType, ThreadPolicy>::~TILED_KD_TREE(){
+    pthread_mutex_lock(&tile_mutex);
+    termination_flag = true;
+    pthread_cond_broadcast(&tile_cond);
+    pthread_mutex_unlock(&tile_mutex);
+    pthread_join(paging_thread, NULL);
+    flush();
+    pthread_mutex_destroy(&tile_mutex);
+    pthread_cond_destroy(&tile_cond);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::set_prefetch_radius(float prefetch_radius){
+    Prefetch_Radius = prefetch_radius;
+    Schedule_Paging();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::set_max_resident_tiles(int tile_num){
+    Max_Resident_Tiles = max(tile_num, 1);
+    Schedule_Paging();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::update_pose(PointType pose){
+    Pose = pose;
+    Pose_Set = true;
+    Schedule_Paging();
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::wait_for_paging(){
+    pthread_mutex_lock(&tile_mutex);
+    while (!Paging_Jobs.empty() || Paging_Busy) pthread_cond_wait(&tile_cond, &tile_mutex);
+    pthread_mutex_unlock(&tile_mutex);
+}
+
+template <typename PointType, typename ThreadPolicy>
+bool TILED_KD_TREE<PointType, ThreadPolicy>::flush(){
+    wait_for_paging();
+    bool success = true;
+    pthread_mutex_lock(&tile_mutex);
+    for (auto iter = Tiles.begin(); iter != Tiles.end(); iter++){
+        Tile_Type & tile = iter->second;
+        if (tile.state != TILE_RESIDENT || !tile.dirty) continue;
+        string path = tile_path(iter->first);
+        if (tile.tree->save(path + ".tmp") && rename((path + ".tmp").c_str(), path.c_str()) == 0){
+            tile.dirty = false;
+            tile.on_disk = true;
+        } else {
+            printf("Failed to save tile %s\n", path.c_str());
+            success = false;
+        }
+    }
+    pthread_mutex_unlock(&tile_mutex);
+    return success;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int TILED_KD_TREE<PointType, ThreadPolicy>::tile_num(){
+    pthread_mutex_lock(&tile_mutex);
+    int num = Tiles.size();
+    pthread_mutex_unlock(&tile_mutex);
+    return num;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int TILED_KD_TREE<PointType, ThreadPolicy>::resident_tile_num(){
+    int num = 0;
+    pthread_mutex_lock(&tile_mutex);
+    for (auto iter = Tiles.begin(); iter != Tiles.end(); iter++){
+        if (iter->second.state == TILE_RESIDENT) num++;
+    }
+    pthread_mutex_unlock(&tile_mutex);
+    return num;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int TILED_KD_TREE<PointType, ThreadPolicy>::size(){
+    vector<typename Tree::Ptr> trees;
+    Resident_Trees(-INFINITY, INFINITY, -INFINITY, INFINITY, trees);
+    int num = 0;
+    for (int i = 0; i < trees.size(); i++) num += trees[i]->size();
+    return num;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int TILED_KD_TREE<PointType, ThreadPolicy>::validnum(){
+    vector<typename Tree::Ptr> trees;
+    Resident_Trees(-INFINITY, INFINITY, -INFINITY, INFINITY, trees);
+    int num = 0;
+    for (int i = 0; i < trees.size(); i++) num += trees[i]->validnum();
+    return num;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::Nearest_Search(PointType point, int k_nearest, PointVector& Nearest_Points, vector<float> & Point_Distance, double max_dist){
+    PointVector().swap(Nearest_Points);
+    vector<float>().swap(Point_Distance);
+    vector<pair<float, typename Tree::Ptr>> candidates;
+    pthread_mutex_lock(&tile_mutex);
+    for (auto iter = Tiles.begin(); iter != Tiles.end(); iter++){
+        if (iter->second.state != TILE_RESIDENT) continue;
+        float dist = tile_dist(iter->first, point.x, point.y);
+        if (dist <= max_dist * max_dist) candidates.push_back(make_pair(dist, iter->second.tree));
+    }
+    pthread_mutex_unlock(&tile_mutex);
+    sort(candidates.begin(), candidates.end(), [](const pair<float, typename Tree::Ptr> & a, const pair<float, typename Tree::Ptr> & b){ return a.first < b.first; });
+    // Tiles are searched nearest first, a farther tile only while it can still hold a closer point than the current k-th
+    PointVector tile_points, merged_points;
+    vector<float> tile_dists, merged_dists;
+    for (int i = 0; i < candidates.size(); i++){
+        bool full = Nearest_Points.size() >= k_nearest;
+        if (full && candidates[i].first >= Point_Distance.back()) break;
+        double search_dist = full ? min(max_dist, double(sqrt(Point_Distance.back()))) : max_dist;
+        candidates[i].second->Nearest_Search(point, k_nearest, tile_points, tile_dists, search_dist);
+        merged_points.clear();
+        merged_dists.clear();
+        int a = 0, b = 0;
+        while (merged_points.size() < k_nearest && (a < Nearest_Points.size() || b < tile_points.size())){
+            if (b >= tile_points.size() || (a < Nearest_Points.size() && Point_Distance[a] <= tile_dists[b])){
+                merged_points.push_back(Nearest_Points[a]);
+                merged_dists.push_back(Point_Distance[a++]);
+            } else {
+                merged_points.push_back(tile_points[b]);
+                merged_dists.push_back(tile_dists[b++]);
+            }
+        }
+        Nearest_Points.swap(merged_points);
+        Point_Distance.swap(merged_dists);
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage){
+    Storage.clear();
+    vector<typename Tree::Ptr> trees;
+    Resident_Trees(Box_of_Point.vertex_min[0], Box_of_Point.vertex_max[0], Box_of_Point.vertex_min[1], Box_of_Point.vertex_max[1], trees);
+    PointVector tile_points;
+    for (int i = 0; i < trees.size(); i++){
+        trees[i]->Box_Search(Box_of_Point, tile_points);
+        Storage.insert(Storage.end(), tile_points.begin(), tile_points.end());
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::Radius_Search(PointType point, const float radius, PointVector &Storage){
+    Storage.clear();
+    vector<typename Tree::Ptr> trees;
+    Resident_Trees(point.x - radius, point.x + radius, point.y - radius, point.y + radius, trees);
+    PointVector tile_points;
+    for (int i = 0; i < trees.size(); i++){
+        trees[i]->Radius_Search(point, radius, tile_points);
+        Storage.insert(Storage.end(), tile_points.begin(), tile_points.end());
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+int TILED_KD_TREE<PointType, ThreadPolicy>::Add_Points(PointVector & PointToAdd, bool downsample_on){
+    unordered_map<Tile_Key_Type, PointVector, Tile_Key_Hash> tile_points;
+    for (int i = 0; i < PointToAdd.size(); i++) tile_points[tile_key(PointToAdd[i].x, PointToAdd[i].y)].push_back(PointToAdd[i]);
+    int tmp_counter = 0;
+    for (auto iter = tile_points.begin(); iter != tile_points.end(); iter++){
+        typename Tree::Ptr tree = Acquire_Tile(iter->first);
+        if (tree == nullptr) continue;
+        // A new or emptied tile has no root to insert into yet
+        if (tree->Root_Node == nullptr){
+            tree->Build(iter->second);
+            tmp_counter += iter->second.size();
+        } else {
+            tmp_counter += tree->Add_Points(iter->second, downsample_on);
+        }
+    }
+    Schedule_Paging();
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int TILED_KD_TREE<PointType, ThreadPolicy>::Delete_Points(PointVector & PointToDel){
+    unordered_map<Tile_Key_Type, PointVector, Tile_Key_Hash> tile_points;
+    pthread_mutex_lock(&tile_mutex);
+    for (int i = 0; i < PointToDel.size(); i++){
+        Tile_Key_Type key = tile_key(PointToDel[i].x, PointToDel[i].y);
+        if (Tiles.count(key)) tile_points[key].push_back(PointToDel[i]);
+    }
+    pthread_mutex_unlock(&tile_mutex);
+    int tmp_counter = 0;
+    for (auto iter = tile_points.begin(); iter != tile_points.end(); iter++){
+        typename Tree::Ptr tree = Acquire_Tile(iter->first);
+        if (tree == nullptr) continue;
+        tmp_counter += tree->Delete_Points(iter->second);
+    }
+    Schedule_Paging();
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+int TILED_KD_TREE<PointType, ThreadPolicy>::Delete_Point_Boxes(vector<BoxPointType> & BoxPoints){
+    unordered_map<Tile_Key_Type, vector<BoxPointType>, Tile_Key_Hash> tile_boxes;
+    pthread_mutex_lock(&tile_mutex);
+    for (auto iter = Tiles.begin(); iter != Tiles.end(); iter++){
+        float x_min = iter->first.x * Tile_Size, y_min = iter->first.y * Tile_Size;
+        for (int i = 0; i < BoxPoints.size(); i++){
+            if (BoxPoints[i].vertex_max[0] <= x_min || BoxPoints[i].vertex_min[0] >= x_min + Tile_Size) continue;
+            if (BoxPoints[i].vertex_max[1] <= y_min || BoxPoints[i].vertex_min[1] >= y_min + Tile_Size) continue;
+            tile_boxes[iter->first].push_back(BoxPoints[i]);
+        }
+    }
+    pthread_mutex_unlock(&tile_mutex);
+    int tmp_counter = 0;
+    for (auto iter = tile_boxes.begin(); iter != tile_boxes.end(); iter++){
+        typename Tree::Ptr tree = Acquire_Tile(iter->first);
+        if (tree == nullptr) continue;
+        tmp_counter += tree->Delete_Point_Boxes(iter->second);
+    }
+    Schedule_Paging();
+    return tmp_counter;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void * TILED_KD_TREE<PointType, ThreadPolicy>::paging_thread_ptr(void * arg){
+    TILED_KD_TREE * handle = (TILED_KD_TREE *) arg;
+    handle->paging_thread_loop();
+    return nullptr;
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::paging_thread_loop(){
+    pthread_mutex_lock(&tile_mutex);
+    while (true){
+        while (Paging_Jobs.empty() && !termination_flag) pthread_cond_wait(&tile_cond, &tile_mutex);
+        // Pending saves are drained before terminating so that no modified tile is lost
+        if (Paging_Jobs.empty()) break;
+        Paging_Job_Type job = Paging_Jobs.front();
+        Paging_Jobs.pop_front();
+        Paging_Busy = true;
+        pthread_mutex_unlock(&tile_mutex);
+        string path = tile_path(job.key);
+        bool success = true;
+        if (job.tree == nullptr){
+            job.tree = New_Tile_Tree();
+            success = job.tree->load(path);
+        } else if (job.dirty){
+            success = job.tree->save(path + ".tmp") && rename((path + ".tmp").c_str(), path.c_str()) == 0;
+        }
+        pthread_mutex_lock(&tile_mutex);
+        Tile_Type & tile = Tiles[job.key];
+        if (tile.state == TILE_LOADING){
+            if (success){
+                tile.tree = job.tree;
+                tile.state = TILE_RESIDENT;
+            } else {
+                printf("Failed to load tile %s\n", path.c_str());
+                tile.state = TILE_ON_DISK;
+            }
+        } else if (tile.state == TILE_SAVING){
+            if (success){
+                if (job.dirty) tile.on_disk = true;
+                tile.state = TILE_ON_DISK;
+            } else {
+                // Keep the tree resident rather than dropping its modifications
+                printf("Failed to save tile %s\n", path.c_str());
+                tile.tree = job.tree;
+                tile.dirty = true;
+                tile.state = TILE_RESIDENT;
+            }
+        }
+        job.tree.reset();
+        Paging_Busy = false;
+        pthread_cond_broadcast(&tile_cond);
+    }
+    pthread_mutex_unlock(&tile_mutex);
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::Schedule_Paging(){
+    pthread_mutex_lock(&tile_mutex);
+    // Without a pose the most recently written tiles come first
+    vector<pair<double, Tile_Key_Type>> order;
+    for (auto iter = Tiles.begin(); iter != Tiles.end(); iter++) order.push_back(make_pair(Pose_Set ? tile_dist(iter->first, Pose.x, Pose.y) : -double(iter->second.last_write), iter->first));
+    sort(order.begin(), order.end(), [](const pair<double, Tile_Key_Type> & a, const pair<double, Tile_Key_Type> & b){ return a.first < b.first; });
+    // The nearest tiles fill the resident slots, tiles already in memory are kept up to one tile beyond the prefetch radius to avoid thrashing
+    int slot_num = 0;
+    float prefetch_sq = Prefetch_Radius * Prefetch_Radius, keep_sq = (Prefetch_Radius + Tile_Size) * (Prefetch_Radius + Tile_Size);
+    bool job_added = false;
+    for (int i = 0; i < order.size(); i++){
+        Tile_Type & tile = Tiles[order[i].second];
+        bool in_memory = tile.state == TILE_RESIDENT || tile.state == TILE_LOADING;
+        bool wanted = Pose_Set ? order[i].first <= prefetch_sq || (in_memory && order[i].first <= keep_sq) : in_memory;
+        if (slot_num < Max_Resident_Tiles && wanted){
+            if (tile.state == TILE_ON_DISK && tile.on_disk){
+                tile.state = TILE_LOADING;
+                Paging_Jobs.push_back(Paging_Job_Type{order[i].second, nullptr, false});
+                job_added = true;
+            }
+            if (tile.state != TILE_ON_DISK) slot_num++;
+        } else if (tile.state == TILE_RESIDENT){
+            Paging_Jobs.push_back(Paging_Job_Type{order[i].second, tile.tree, tile.dirty});
+            tile.tree.reset();
+            tile.dirty = false;
+            tile.state = TILE_SAVING;
+            job_added = true;
+        }
+    }
+    if (job_added) pthread_cond_broadcast(&tile_cond);
+    pthread_mutex_unlock(&tile_mutex);
+}
+
+template <typename PointType, typename ThreadPolicy>
+typename TILED_KD_TREE<PointType, ThreadPolicy>::Tree::Ptr TILED_KD_TREE<PointType, ThreadPolicy>::Acquire_Tile(Tile_Key_Type key){
+    pthread_mutex_lock(&tile_mutex);
+    while (true){
+        Tile_Type & tile = Tiles[key];
+        if (tile.state == TILE_LOADING || tile.state == TILE_SAVING){
+            pthread_cond_wait(&tile_cond, &tile_mutex);
+            continue;
+        }
+        if (tile.state == TILE_ON_DISK){
+            typename Tree::Ptr tree = New_Tile_Tree();
+            if (tile.on_disk){
+                tile.state = TILE_LOADING;
+                pthread_mutex_unlock(&tile_mutex);
+                bool success = tree->load(tile_path(key));
+                pthread_mutex_lock(&tile_mutex);
+                Tile_Type & loaded_tile = Tiles[key];
+                if (!success){
+                    printf("Failed to load tile %s\n", tile_path(key).c_str());
+                    loaded_tile.state = TILE_ON_DISK;
+                    pthread_cond_broadcast(&tile_cond);
+                    pthread_mutex_unlock(&tile_mutex);
+                    return nullptr;
+                }
+                loaded_tile.tree = tree;
+                loaded_tile.state = TILE_RESIDENT;
+                pthread_cond_broadcast(&tile_cond);
+            } else {
+                tile.tree = tree;
+                tile.state = TILE_RESIDENT;
+            }
+        }
+        // The caller is about to modify the tile
+        Tile_Type & resident_tile = Tiles[key];
+        resident_tile.dirty = true;
+        resident_tile.last_write = ++Write_Counter;
+        typename Tree::Ptr tree = resident_tile.tree;
+        pthread_mutex_unlock(&tile_mutex);
+        return tree;
+    }
+}
+
+template <typename PointType, typename ThreadPolicy>
+typename TILED_KD_TREE<PointType, ThreadPolicy>::Tree::Ptr TILED_KD_TREE<PointType, ThreadPolicy>::New_Tile_Tree(){
+    return typename Tree::Ptr(new Tree(Delete_Param, Balance_Param, Box_Length, Rebuild_Policy));
+}
+
+template <typename PointType, typename ThreadPolicy>
+void TILED_KD_TREE<PointType, ThreadPolicy>::Resident_Trees(float x_min, float x_max, float y_min, float y_max, vector<typename Tree::Ptr> & trees){
+    trees.clear();
+    pthread_mutex_lock(&tile_mutex);
+    for (auto iter = Tiles.begin(); iter != Tiles.end(); iter++){
+        if (iter->second.state != TILE_RESIDENT) continue;
+        float tile_x = iter->first.x * Tile_Size, tile_y = iter->first.y * Tile_Size;
+        if (x_max < tile_x || x_min >= tile_x + Tile_Size || y_max < tile_y || y_min >= tile_y + Tile_Size) continue;
+        trees.push_back(iter->second.tree);
+    }
+    pthread_mutex_unlock(&tile_mutex);
+}
+
+template <typename PointType, typename ThreadPolicy>
+typename TILED_KD_TREE<PointType, ThreadPolicy>::Tile_Key_Type TILED_KD_TREE<PointType, ThreadPolicy>::tile_key(float x, float y){
+    Tile_Key_Type key;
+    key.x = int(floor(x / Tile_Size));
+    key.y = int(floor(y / Tile_Size));
+    return key;
+}
+
+template <typename PointType, typename ThreadPolicy>
+string TILED_KD_TREE<PointType, ThreadPolicy>::tile_path(Tile_Key_Type key){
+    return Directory + "/tile_" + to_string(key.x) + "_" + to_string(key.y) + ".ikd";
+}
+
+template <typename PointType, typename ThreadPolicy>
+float TILED_KD_TREE<PointType, ThreadPolicy>::tile_dist(Tile_Key_Type key, float x, float y){
+    float tile_x = key.x * Tile_Size, tile_y = key.y * Tile_Size, dist = 0.0f;
+    if (x < tile_x) dist += (tile_x - x) * (tile_x - x);
+    if (x > tile_x + Tile_Size) dist += (x - tile_x - Tile_Size) * (x - tile_x - Tile_Size);
+    if (y < tile_y) dist += (tile_y - y) * (tile_y - y);
+    if (y > tile_y + Tile_Size) dist += (y - tile_y - Tile_Size) * (y - tile_y - Tile_Size);
+    return dist;
+}
+
 template class KD_TREE<ikdTree_PointType>;
 template class KD_TREE<pcl::PointXYZ>;
 template class KD_TREE<pcl::PointXYZI>;
-template class KD_TREE<pcl::PointXYZINormal>;
\ No newline at end of file
+template class KD_TREE<pcl::PointXYZINormal>;
+template class KD_TREE<ikdTree_PointType, SingleThreaded>;
+template class KD_TREE<pcl::PointXYZ, SingleThreaded>;
+template class KD_TREE<pcl::PointXYZI, SingleThreaded>;
+template class KD_TREE<pcl::PointXYZINormal, SingleThreaded>;
+template class STATIC_KD_TREE<ikdTree_PointType>;
+template class STATIC_KD_TREE<pcl::PointXYZ>;
+template class STATIC_KD_TREE<pcl::PointXYZI>;
+template class STATIC_KD_TREE<pcl::PointXYZINormal>;
+template class TILED_KD_TREE<ikdTree_PointType>;
+template class TILED_KD_TREE<pcl::PointXYZ>;
+template class TILED_KD_TREE<pcl::PointXYZI>;
+template class TILED_KD_TREE<pcl::PointXYZINormal>;
+template class TILED_KD_TREE<ikdTree_PointType, MultiThreaded>;
+template class TILED_KD_TREE<pcl::PointXYZ, MultiThreaded>;
+template class TILED_KD_TREE<pcl::PointXYZI, MultiThreaded>;
+template class TILED_KD_TREE<pcl::PointXYZINormal, MultiThreaded>;
@@ -2,12 +2,26 @@
 #include <stdio.h>
 #include <queue>
 #include <pthread.h>
+#include <errno.h>
+#include <sched.h>
 #include <chrono>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <math.h>
+#include <limits.h>
 #include <algorithm>
 #include <memory>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <string>
+#include <sstream>
 #include <pcl/point_types.h>
 
 #define EPSS 1e-6
@@ -15,8 +29,37 @@
 #define Multi_Thread_Rebuild_Point_Num 1500
 #define DOWNSAMPLE_SWITCH true
 #define ForceRebuildPercentage 0.2
+#define EvictionSlackPercentage 0.05
+#define Query_Stamp_Cell_Size 1.0
+#define Query_Stamp_Table_Size 262144
+#define SurfaceAreaSplitBins 16
+#define Max_Recycled_Node_Num 100000
+#define HistogramSelectBins 256
+#define HistogramSelectMinSize 2048
+#define Tree_File_Version 1
+#define Tree_File_Chunk_Size 65536
+#define Static_Tree_File_Version 1
+#define Max_Resident_Tile_Num 64
+#define Journal_File_Version 1
+#define Journal_Batch_Bytes 65536
+#define Journal_Checkpoint_Bytes (64 << 20)
+#define Trace_File_Version 2
+#define Point_File_Chunk_Size 65536
+#define Latency_Sub_Bucket_Bits 5
+#define Latency_Bucket_Num ((66 - Latency_Sub_Bucket_Bits) << (Latency_Sub_Bucket_Bits - 1))
 #define Q_LEN 1000000
 
+// Build with -DLATENCY_STATS_SWITCH=1 to record per-operation latency histograms, otherwise no timing code or storage is compiled in.
+// It changes the layout of KD_TREE, so it must be set alike for ikd_Tree.cpp and every file including this header.
+#ifndef LATENCY_STATS_SWITCH
+#define LATENCY_STATS_SWITCH 0
+#endif
+#if LATENCY_STATS_SWITCH
+#define LATENCY_SCOPE(op) Latency_Scope_Type latency_scope(this, op)
+#else
+#define LATENCY_SCOPE(op)
+#endif
+
 using namespace std;
 
 struct ikdTree_PointType
@@ -34,15 +77,95 @@ struct BoxPointType{
     float vertex_max[3];
 };
 
-enum operation_set {ADD_POINT, DELETE_POINT, DELETE_BOX, ADD_BOX, DOWNSAMPLE_DELETE, PUSH_DOWN};
+enum operation_set {ADD_POINT, DELETE_POINT, DELETE_BOX, ADD_BOX, DOWNSAMPLE_DELETE, PUSH_DOWN, DELETE_OUTSIDE_BOX, DELETE_OLDER_THAN};
 
 enum delete_point_storage_set {NOT_RECORD, DELETE_POINTS_REC, MULTI_THREAD_REC};
 
-template <typename T>
+enum rebuild_mode_set {MULTI_THREAD_REBUILD, EXECUTOR_REBUILD, SYNC_REBUILD};
+
+enum eviction_policy_set {EVICT_FARTHEST, EVICT_OLDEST, EVICT_LEAST_QUERIED};
+
+enum split_strategy_set {SPLIT_MEDIAN, SPLIT_SLIDING_MIDPOINT, SPLIT_SURFACE_AREA};
+
+// Format of KD_TREE::build_from_file, POINT_FILE_BY_EXTENSION reads .pcd files as PCD and any other file as raw floats
+enum point_file_format_set {POINT_FILE_BY_EXTENSION, POINT_FILE_PCD, POINT_FILE_RAW};
+
+enum trace_op_set {TRACE_BUILD, TRACE_ADD_POINTS, TRACE_DELETE_POINTS, TRACE_DELETE_BOXES, TRACE_ADD_BOXES, TRACE_NEAREST_SEARCH, TRACE_BOX_SEARCH, TRACE_RADIUS_SEARCH,
+                   TRACE_DELETE_OUTSIDE_BOX, TRACE_DELETE_OLDER_THAN, TRACE_RUN_PENDING_REBUILDS, TRACE_FLUSH_INSERT_BUFFER, TRACE_CONFIGURE, TRACE_OP_NUM};
+
+// Histograms of latency_stats: Add_Points, Delete_Points, Delete_Point_Boxes and Delete_Outside_Box, Nearest_Search, Box_Search and Radius_Search, subtree rebuilds
+enum latency_op_set {LATENCY_INSERT, LATENCY_DELETE, LATENCY_BOX_DELETE, LATENCY_KNN, LATENCY_RANGE_SEARCH, LATENCY_REBUILD, LATENCY_OP_NUM};
+
+enum rebuild_trigger_set {REBUILD_DELETE_CRITERION, REBUILD_BALANCE_CRITERION};
+
+/*
+    How large subtrees (>= Multi_Thread_Rebuild_Point_Num points) are rebuilt:
+    MULTI_THREAD_REBUILD - on a dedicated thread, optionally pinned to cpu_affinity and run with sched_policy/sched_priority
+    EXECUTOR_REBUILD     - as tasks handed to executor, which must run them asynchronously
+    SYNC_REBUILD         - inline in the calling thread, no thread is created
+    The constructor throws if the rebuild thread cannot be started with the requested affinity or scheduling class.
+*/
+struct RebuildPolicyType{
+    rebuild_mode_set mode = MULTI_THREAD_REBUILD;
+    vector<int> cpu_affinity;
+    int sched_policy = -1;
+    int sched_priority = 0;
+    function<void(function<void()>)> executor;
+};
+
+// Summary of one latency histogram, percentiles are the upper bound of their bucket, at most 1/16 above the recorded latency
+struct LatencyStatsType{
+    long long count = 0;
+    double mean_us = 0.0;
+    double max_us = 0.0;
+    double p50_us = 0.0;
+    double p90_us = 0.0;
+    double p99_us = 0.0;
+    double p999_us = 0.0;
+};
+
+/*
+    One subtree rebuild, handed to the callback of KD_TREE::set_rebuild_callback. Times are in us.
+    tree_size counts the nodes replaced including deleted points, valid_size the points of the new subtree.
+    Readers are blocked during the flatten of a background rebuild and again while the new subtree is swapped in (swap_block_us).
+    replayed_ops and logger_peak describe the operations logged by writers while a background rebuild was building.
+*/
+struct RebuildEventType{
+    rebuild_trigger_set trigger = REBUILD_BALANCE_CRITERION;
+    bool background = false;
+    int tree_size = 0;
+    int valid_size = 0;
+    double flatten_us = 0.0;
+    double build_us = 0.0;
+    double replay_us = 0.0;
+    double swap_block_us = 0.0;
+    double total_us = 0.0;
+    int replayed_ops = 0;
+    int logger_peak = 0;
+};
+
+// Totals of the rebuild events since construction or the last reset of KD_TREE::rebuild_stats
+struct RebuildStatsType{
+    long long inline_num = 0;
+    long long background_num = 0;
+    long long delete_triggered_num = 0;
+    long long balance_triggered_num = 0;
+    long long rebuilt_point_num = 0;
+    int max_tree_size = 0;
+    double flatten_us = 0.0;
+    double build_us = 0.0;
+    double replay_us = 0.0;
+    double swap_block_us = 0.0;
+    double max_swap_block_us = 0.0;
+    long long replayed_ops = 0;
+    int max_logger_size = 0;
+};
+
+template <typename T, int Q_Capacity = Q_LEN>
 class MANUAL_Q{
     private:
         int head = 0,tail = 0, counter = 0;
-        T q[Q_LEN];
+        T q[Q_Capacity];
         bool is_empty;
     public:
         void pop();
@@ -55,12 +178,40 @@ class MANUAL_Q{
 };
 
 
+// Read-only static tree file. Nodes are stored in pre-order and address their children by index, so the file can be mapped anywhere.
+// The left son of node i is i+1, the right son is i+1+left_size, and every subtree occupies tree_size consecutive records.
+struct Static_Tree_Header_Type{
+    char magic[4];
+    uint32_t version;
+    uint32_t point_size;
+    uint32_t node_size;
+    int64_t node_num;
+    char reserved[40];
+};
 
 template<typename PointType>
+struct Static_Tree_Node_Type{
+    PointType point;
+    float node_range[6];
+    int32_t tree_size;
+    int32_t left_size;
+    uint8_t division_axis;
+};
+
+// Thread policies of KD_TREE. SingleThreaded compiles out all locking and the rebuild thread, every rebuild runs inline.
+struct MultiThreaded{
+    static constexpr bool Multi_Thread = true;
+};
+
+struct SingleThreaded{
+    static constexpr bool Multi_Thread = false;
+};
+
+template<typename PointType, typename ThreadPolicy = MultiThreaded>
 class KD_TREE{
 public:
     using PointVector = vector<PointType>;
-    using Ptr = shared_ptr<KD_TREE<PointType>>;
+    using Ptr = shared_ptr<KD_TREE<PointType, ThreadPolicy>>;
     struct KD_TREE_NODE{
         PointType point;
         uint8_t division_axis;  
@@ -74,9 +225,11 @@ public:
         bool need_push_down_to_left = false;
         bool need_push_down_to_right = false;
         bool working_flag = false;
+        bool rebuild_pending = false;
+        bool tree_rebuild_pending = false;
         float radius_sq;
-        pthread_mutex_t push_down_mutex_lock;
         float node_range_x[2], node_range_y[2], node_range_z[2];   
+        double time_min, time_max;
         KD_TREE_NODE *left_son_ptr = nullptr;
         KD_TREE_NODE *right_son_ptr = nullptr;
         KD_TREE_NODE *father_ptr = nullptr;
@@ -89,9 +242,154 @@ public:
         PointType point;
         BoxPointType boxpoint;
         bool tree_deleted, tree_downsample_deleted;
+        double timestamp;
         operation_set op;
     };
 
+    // Lazy deletion tags inherited from ancestors whose Push_Down has not been applied yet.
+    struct Lazy_Tag_Type{
+        bool pushed = false;
+        bool tree_deleted = false;
+        bool tree_downsample_deleted = false;
+    };
+
+    // Inclusive range of point timestamps accepted by a windowed search
+    struct Time_Window_Type{
+        double time_min;
+        double time_max;
+    };
+
+    // Compact copy of a point partitioned by BuildTree, the full point is read back through index
+    struct Build_Point_Type{
+        float coord[3];
+        int index;
+    };
+
+    struct Build_Split_Type{
+        int mid;
+        int axis;
+    };
+
+    // Layout of the records of a mapped point file, offset is -1 for a field the file does not have
+    enum point_file_field_set {FIELD_X, FIELD_Y, FIELD_Z, FIELD_INTENSITY, FIELD_NORMAL_X, FIELD_NORMAL_Y, FIELD_NORMAL_Z, FIELD_CURVATURE, FIELD_NUM};
+    struct Point_File_Type{
+        const char * data;
+        size_t point_num;
+        size_t stride;
+        int offset[FIELD_NUM];
+        int size[FIELD_NUM];
+    };
+
+    // Header and pre-order node records of the binary file written by save
+    struct Tree_File_Header_Type{
+        char magic[4];
+        uint32_t version;
+        uint32_t point_size;
+        uint32_t node_size;
+        int64_t node_num;
+        int64_t buffer_num;
+    };
+
+    struct Serialized_Node_Type{
+        PointType point;
+        float node_range[6];
+        float radius_sq;
+        double time_min, time_max;
+        int TreeSize, invalid_point_num, down_del_num;
+        uint8_t division_axis;
+        uint8_t flags;
+    };
+
+    // Header and records of the operation journal. Each record is one public operation followed by its num points or boxes.
+    struct Journal_File_Header_Type{
+        char magic[4];
+        uint32_t version;
+        uint32_t point_size;
+        uint32_t reserved;
+        int64_t generation;
+    };
+
+    struct Journal_Record_Type{
+        uint32_t op;
+        uint32_t num;
+        double time;
+        uint32_t downsample_on;
+        uint32_t checksum;
+    };
+
+    // Configuration of a traced tree, in the trace header for the tree replaying it and in a TRACE_CONFIGURE record after every setter
+    // called while tracing. The timestamp function of set_point_timestamp cannot be recorded and is set by the caller of replay_trace.
+    struct Trace_Config_Type{
+        uint32_t rebuild_mode;
+        float delete_param;
+        float balance_param;
+        float downsample_size;
+        int32_t minimal_unbalanced_tree_size;
+        int32_t multi_thread_rebuild_point_num;
+        uint32_t adaptive_rebuild;
+        uint32_t split_strategy;
+        uint32_t voxel_index;
+        int32_t insert_buffer_size;
+        int32_t max_point_num;
+        uint32_t eviction_policy;
+        float eviction_center[3];
+    };
+
+    // Header and records of a trace written by start_trace. Each record is one public call followed by its num points, boxes or configuration,
+    // param holds max_dist, time_min and time_max of a nearest search, the radius of a radius search, the time of Delete_Older_Than
+    // or the time budget of Add_Points, Delete_Points and run_pending_rebuilds.
+    struct Trace_File_Header_Type{
+        char magic[4];
+        uint32_t version;
+        uint32_t point_size;
+        uint32_t reserved;
+        Trace_Config_Type config;
+    };
+
+    struct Trace_Record_Type{
+        uint32_t op;
+        uint32_t num;
+        int32_t k_nearest;
+        uint32_t downsample_on;
+        double param[3];
+    };
+
+    struct Tree_File_Reader_Type{
+        FILE * fp;
+        vector<Serialized_Node_Type> chunk;
+        size_t chunk_pos = 0;
+        int64_t remaining_num = 0;
+    };
+
+    struct Voxel_Point_Type{
+        int64_t voxel[3];
+        int index;
+        bool same_voxel(const Voxel_Point_Type &a)const{
+            return voxel[0] == a.voxel[0] && voxel[1] == a.voxel[1] && voxel[2] == a.voxel[2];
+        }
+        bool operator < (const Voxel_Point_Type &a)const{
+            if (voxel[0] != a.voxel[0]) return voxel[0] < a.voxel[0];
+            if (voxel[1] != a.voxel[1]) return voxel[1] < a.voxel[1];
+            if (voxel[2] != a.voxel[2]) return voxel[2] < a.voxel[2];
+            return index < a.index;
+        }
+    };
+
+    struct Voxel_Key_Type{
+        int64_t voxel[3];
+        bool operator == (const Voxel_Key_Type &a)const{
+            return voxel[0] == a.voxel[0] && voxel[1] == a.voxel[1] && voxel[2] == a.voxel[2];
+        }
+    };
+
+    struct Voxel_Key_Hash{
+        size_t operator () (const Voxel_Key_Type &key)const{
+            return (size_t(key.voxel[0]) * 73856093) ^ (size_t(key.voxel[1]) * 19349669) ^ (size_t(key.voxel[2]) * 83492791);
+        }
+    };
+
+    using Voxel_Map_Type = unordered_map<Voxel_Key_Type, PointVector, Voxel_Key_Hash>;
+
     struct PointType_CMP{
         PointType point;
         float dist = 0.0;
@@ -136,6 +434,9 @@ public:
             int size(){ return heap_size;}
 
             void clear(){ heap_size = 0;}
+
+            // Nodes visited by the search filling this heap
+            int visit_num = 0;
         private:
             int heap_size = 0;
             int cap = 0;        
@@ -175,77 +476,378 @@ private:
     // Multi-thread Tree Rebuild
     bool termination_flag = false;
     bool rebuild_flag = false;
+    bool rebuild_thread_started = false;
+    bool rebuild_task_pending = false;
+    RebuildPolicyType Rebuild_Policy;
     pthread_t rebuild_thread;
     pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex, search_flag_mutex;
-    pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock;
+    pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock, trace_mutex_lock, rebuild_stats_mutex_lock;
+    pthread_cond_t rebuild_task_cond;
     // queue<Operation_Logger_Type> Rebuild_Logger;
-    MANUAL_Q<Operation_Logger_Type> Rebuild_Logger;    
+    MANUAL_Q<Operation_Logger_Type, ThreadPolicy::Multi_Thread ? Q_LEN : 1> Rebuild_Logger;    
     PointVector Rebuild_PCL_Storage;
     KD_TREE_NODE ** Rebuild_Ptr = nullptr;
     int search_mutex_counter = 0;
     static void * multi_thread_ptr(void *arg);
     void multi_thread_rebuild();
+    void executor_rebuild();
+    void background_rebuild();
     void start_thread();
     void stop_thread();
     void run_operation(KD_TREE_NODE ** root, Operation_Logger_Type operation);
+    bool in_background_rebuild(KD_TREE_NODE * root);
     // KD Tree Functions and augmented variables
     int Treesize_tmp = 0, Validnum_tmp = 0;
     float alpha_bal_tmp = 0.5, alpha_del_tmp = 0.0;
     float delete_criterion_param = 0.5f;
     float balance_criterion_param = 0.7f;
+    int minimal_unbalanced_tree_size = Minimal_Unbalanced_Tree_Size;
+    int multi_thread_rebuild_point_num = Multi_Thread_Rebuild_Point_Num;
+    // Optional cost model gating Criterion_Check, fed by measured rebuild and nearest search timings (ns)
+    bool Adaptive_Rebuild = false;
+    atomic<long long> Rebuild_Time_Total{0}, Rebuild_Point_Total{0};
+    atomic<long long> Query_Time_Total{0}, Query_Level_Total{0}, Query_Num{0}, Update_Num{0};
+    bool Rebuild_Pays_Off(KD_TREE_NODE * root, float delete_evaluation, float balance_evaluation);
+    // Synchronous rebuilds triggered inside a budgeted call are only marked pending, then resumed while the budget lasts
+    bool Defer_Rebuild = false;
+    void Begin_Budgeted_Call(double time_budget_ms);
+    void End_Budgeted_Call(chrono::high_resolution_clock::time_point call_start, double time_budget_ms);
+    int Rebuild_pending(KD_TREE_NODE ** root, chrono::high_resolution_clock::time_point deadline);
     float downsample_size = 0.2f;
+    split_strategy_set Split_Strategy = SPLIT_MEDIAN;
+    // Visit counting is off by default, so that concurrent searches do not contend on the shared counters
+    bool Search_Visit_Stats_Enabled = false;
+    atomic<long long> Search_Num{0}, Search_Visit_Num{0};
+    int Sliding_Midpoint_Split(int l, int r, vector<Build_Point_Type> & build_points, int div_axis, float split_value);
+    int Surface_Area_Split(int l, int r, vector<Build_Point_Type> & build_points, const float min_value[3], const float max_value[3], int & div_axis);
+    int Balanced_Split_Index(int l, int r, int mid);
     bool Delete_Storage_Disabled = false;
     KD_TREE_NODE * STATIC_ROOT_NODE = nullptr;
+    // Removed points are only recorded on request, either kept for acquire_removed_points or handed to the callback after each rebuild
+    bool Removed_Points_Enabled = false;
+    function<void(const PointVector &)> Removed_Points_Callback;
     PointVector Points_deleted;
     PointVector Downsample_Storage;
+    PointVector Delete_Storage;
+    vector<Voxel_Point_Type> Downsample_Voxels;
+    // Optional index of the valid points per downsample voxel, kept in sync by the public operations
+    bool Voxel_Index_Enabled = false;
+    Voxel_Map_Type Voxel_Index;
+    Voxel_Key_Type voxel_key(PointType point);
+    void Voxel_Index_Insert(PointType point);
+    void Voxel_Index_Delete(PointType point);
+    void Voxel_Index_Delete_Box(BoxPointType boxpoint);
+    void Voxel_Index_Delete_Box(PointVector & voxel_points, const BoxPointType & boxpoint);
+    // Points removed by a crop or by age, collected only to keep the voxel index in sync
+    PointVector Removed_Storage;
+    // Optional flat insertion buffer, searched by brute force and merged into the tree in one batch when full
+    int Insert_Buffer_Size = 0;
+    PointVector Insert_Buffer;
+    vector<float> Insert_Buffer_Coord[3];
+    vector<float> Insert_Buffer_Dist;
+    void Buffer_Search(int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist, const Time_Window_Type * window);
+    void Buffer_Search_by_range(const BoxPointType &boxpoint, PointVector &Storage);
+    void Buffer_Search_by_radius(PointType point, float radius, PointVector &Storage);
+    bool Buffer_Delete(PointType point);
+    int Buffer_Delete_by_range(const BoxPointType &boxpoint);
+    int Buffer_Delete_outside_range(const BoxPointType &boxpoint);
+    int Buffer_Delete_older_than(double time);
+    void Buffer_Remove(int index);
+    void Merge_Insert_Buffer();
+    // Optional per-point timestamp read from the point itself, aggregated per subtree into time_min/time_max
+    function<double(const PointType &)> Point_Timestamp;
+    void Update_Time_Range(KD_TREE_NODE * root);
+    void Rebuild_Time_Range(KD_TREE_NODE * root);
+    // Optional bound on the number of valid points, enforced by lazily deleting whole subtrees after Add_Points.
+    // Deleted nodes awaiting a rebuild and the recycled node pools are not counted, so memory is not bounded by the cap alone.
+    int Max_Point_Num = 0;
+    eviction_policy_set Eviction_Policy = EVICT_FARTHEST;
+    PointType Eviction_Center;
+    PointVector Evicted_Storage;
+    void Enforce_Capacity();
+    int Apply_Delete_Outside_Box(const BoxPointType & BoxPoint);
+    int Apply_Delete_Older_Than(double time);
+    BoxPointType Farthest_Eviction_Box(int evict_num);
+    double Oldest_Eviction_Time(int evict_num);
+    // Query recency per hashed grid cell, stamped after each kNN search so that the search itself never writes to the tree
+    atomic<int> Query_Clock{0};
+    unique_ptr<atomic<int>[]> Query_Stamps;
+    atomic<int> & query_stamp(PointType point);
+    int Least_Queried_Cutoff(int evict_num, int & cutoff_num);
+    void Collect_Query_Stamps(KD_TREE_NODE * root, Lazy_Tag_Type tag, vector<int> & stamps);
+    int Evict_least_queried(KD_TREE_NODE ** root, int cutoff_stamp, int & cutoff_num, bool allow_rebuild, bool record);
+    int Count_outside_range(KD_TREE_NODE * root, const BoxPointType & boxpoint, Lazy_Tag_Type tag);
+    int Count_older_than(KD_TREE_NODE * root, double time, Lazy_Tag_Type tag);
     PointVector Multithread_Points_deleted;
+    // Nodes of rebuilt subtrees are kept for the next BuildTree, the background rebuild keeps its own pool
+    vector<KD_TREE_NODE *> Node_Pool;
+    vector<KD_TREE_NODE *> Background_Node_Pool;
+    KD_TREE_NODE * new_tree_node(vector<KD_TREE_NODE *> * node_pool);
+    void recycle_tree_nodes(KD_TREE_NODE ** root, vector<KD_TREE_NODE *> & node_pool);
+    void release_node_pool(vector<KD_TREE_NODE *> & node_pool, int keep_num);
+    void Discard_Tree();
+    // Optional write-ahead journal of the public operations on top of the checkpoint of generation Journal_Generation
+    string Journal_Path;
+    int Journal_Fd = -1;
+    int64_t Journal_Generation = 0;
+    bool Journal_Sync = true;
+    bool Journal_Replaying = false;
+    bool Journal_Checkpoint_Due = false;
+    size_t Journal_Batch_Limit = Journal_Batch_Bytes;
+    size_t Journal_Checkpoint_Limit = Journal_Checkpoint_Bytes;
+    size_t Journal_Size = 0;
+    vector<char> Journal_Buffer;
+    void Journal_Append(operation_set op, const void * payload, uint32_t num, bool downsample_on = false, double time = 0.0);
+    bool Journal_Replay(int fd, off_t & valid_size);
+    bool Journal_Create(int64_t generation);
+    string checkpoint_path(int64_t generation);
+    bool sync_path(const string & path);
+    uint32_t journal_checksum(const char * data, size_t size, uint32_t hash);
+#if LATENCY_STATS_SWITCH
+    // Log-linear histograms in ns: exact below 2^Latency_Sub_Bucket_Bits, then 2^(Latency_Sub_Bucket_Bits-1) buckets per power of two
+    struct Latency_Histogram_Type{
+        atomic<long long> count, total_ns, max_ns;
+        atomic<long long> bucket[Latency_Bucket_Num];
+    };
+    // Records the latency of the scope it is declared in
+    struct Latency_Scope_Type{
+        KD_TREE * tree;
+        latency_op_set op;
+        chrono::high_resolution_clock::time_point start;
+        Latency_Scope_Type(KD_TREE * tree_ptr, latency_op_set latency_op): tree(tree_ptr), op(latency_op), start(chrono::high_resolution_clock::now()){}
+        ~Latency_Scope_Type(){
+            tree->Latency_Record(op, chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - start).count());
+        }
+    };
+    Latency_Histogram_Type Latency_Histograms[LATENCY_OP_NUM];
+    void Latency_Record(latency_op_set op, long long latency_ns);
+#endif
+    // Rebuild telemetry, Rebuild_Trigger belongs to the subtree waiting in Rebuild_Ptr
+    rebuild_trigger_set Rebuild_Trigger = REBUILD_BALANCE_CRITERION;
+    RebuildStatsType Rebuild_Stats;
+    function<void(const RebuildEventType &)> Rebuild_Callback;
+    rebuild_trigger_set Rebuild_Trigger_of(KD_TREE_NODE * root);
+    void Record_Rebuild(const RebuildEventType & event);
+    // Optional trace of the public calls, written through a stdio buffer
+    atomic<FILE *> Trace_File{nullptr};
+    bool Trace_Replaying = false;
+    Trace_Config_Type Trace_Config();
+    bool Apply_Trace_Config(const Trace_Config_Type & config);
+    size_t Trace_Payload_Size(uint32_t op);
+    void Trace_Configure();
+    void Trace_Append(trace_op_set op, const void * payload, uint32_t num, int k_nearest = 0, bool downsample_on = false, double param_0 = 0.0, double param_1 = 0.0, double param_2 = 0.0);
+    int Build_Static_Nodes(int l, int r, const PointVector & Storage, const vector<Build_Split_Type> & splits, int & split_counter, vector<Static_Tree_Node_Type<PointType>> & nodes);
+    bool Save_Tree(KD_TREE_NODE * root, FILE * fp, vector<Serialized_Node_Type> & chunk, int64_t & node_num);
+    bool Load_Tree(KD_TREE_NODE ** root, KD_TREE_NODE * father, Tree_File_Reader_Type & reader, vector<KD_TREE_NODE *> & node_pool);
     void InitTreeNode(KD_TREE_NODE * root);
     void Test_Lock_States(KD_TREE_NODE *root);
-    void BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage);
+    void BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage, vector<KD_TREE_NODE *> * node_pool = nullptr);
+    void Partition_Points(int l, int r, PointVector & Storage, vector<Build_Split_Type> & splits);
+    void Partition_by_index(int l, int r, vector<Build_Point_Type> & build_points, vector<Build_Point_Type> & build_buffer, vector<Build_Split_Type> & splits);
+    void Select_by_histogram(int l, int r, int mid, int div_axis, float min_value, float max_value, vector<Build_Point_Type> & build_points, vector<Build_Point_Type> & build_buffer);
+    void Build_by_splits(KD_TREE_NODE ** root, int l, int r, PointVector & Storage, const vector<Build_Split_Type> & splits, int & split_counter, vector<KD_TREE_NODE *> * node_pool, int storage_offset = 0);
+    void Build_by_file_splits(KD_TREE_NODE ** root, int l, int r, const Point_File_Type & file, const vector<Build_Point_Type> & build_points, const vector<Build_Split_Type> & splits, int & split_counter, PointVector & chunk);
+    bool Parse_Point_File(const char * data, size_t file_size, point_file_format_set format, int raw_field_num, Point_File_Type & file);
+    float Read_File_Field(const Point_File_Type & file, size_t index, int field);
+    void Read_File_Point(const Point_File_Type & file, size_t index, PointType & point);
     void Rebuild(KD_TREE_NODE ** root);
     int Delete_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample);
+    int Delete_outside_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild, bool record);
+    int Delete_older_than(KD_TREE_NODE ** root, double time, bool allow_rebuild, bool record);
     void Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild);
+    int Delete_by_batch(KD_TREE_NODE ** root, PointVector & Storage, int l, int r, bool allow_rebuild);
     void Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild, int father_axis);
     void Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild);
-    void Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist);//priority_queue<PointType_CMP>
-    void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage);
-    void Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage);
+    void Add_by_batch(KD_TREE_NODE ** root, PointVector & Storage, int l, int r, bool allow_rebuild);
+    void Log_Batch_Points(PointVector & Storage, int l, int r, operation_set op);
+    void Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist, Lazy_Tag_Type tag = Lazy_Tag_Type(), const Time_Window_Type * window = nullptr);//priority_queue<PointType_CMP>
+    void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    void Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    void flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type, Lazy_Tag_Type tag);
     bool Criterion_Check(KD_TREE_NODE * root);
     void Push_Down(KD_TREE_NODE * root);
+    bool Resolve_Lazy_Tag(KD_TREE_NODE * root, const Lazy_Tag_Type & tag, bool & point_deleted, bool & point_downsample_deleted, Lazy_Tag_Type & left_tag, Lazy_Tag_Type & right_tag);
     void Update(KD_TREE_NODE * root); 
     void delete_tree_nodes(KD_TREE_NODE ** root);
     void downsample(KD_TREE_NODE ** root);
     bool same_point(PointType a, PointType b);
     float calc_dist(PointType a, PointType b);
     float calc_box_dist(KD_TREE_NODE * node, PointType point);    
-    static bool point_cmp_x(PointType a, PointType b); 
-    static bool point_cmp_y(PointType a, PointType b); 
-    static bool point_cmp_z(PointType a, PointType b); 
 
 public:
-    KD_TREE(float delete_param = 0.5, float balance_param = 0.6 , float box_length = 0.2);
+    KD_TREE(float delete_param = 0.5, float balance_param = 0.6 , float box_length = 0.2, RebuildPolicyType rebuild_policy = RebuildPolicyType());
     ~KD_TREE();
     void Set_delete_criterion_param(float delete_param);
     void Set_balance_criterion_param(float balance_param);
+    void Set_minimal_unbalanced_tree_size(int tree_size);
+    void Set_multi_thread_rebuild_point_num(int point_num);
+    void set_adaptive_rebuild(bool enable);
+    void rebuild_cost_model(double &rebuild_cost_per_point, double &query_cost_per_level, double &traversals_per_update);
     void set_downsample_param(float box_length);
+    void set_split_strategy(split_strategy_set strategy);
+    void set_search_visit_stats(bool enable);
+    void search_visit_stats(long long & search_num, long long & visit_num, bool reset = false);
+    void set_voxel_index(bool enable);
+    void set_insert_buffer(int buffer_size);
+    void flush_insert_buffer();
+    void set_point_timestamp(function<double(const PointType &)> timestamp_of);
+    void set_capacity(int max_points, eviction_policy_set policy = EVICT_FARTHEST);
+    void set_eviction_center(PointType center);
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2); 
     int size();
     int validnum();
     void root_alpha(float &alpha_bal, float &alpha_del);
     void Build(PointVector point_cloud);
+    bool build_from_file(const string & path, point_file_format_set format = POINT_FILE_BY_EXTENSION, int raw_field_num = 3);
     void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance, double max_dist = INFINITY);
+    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance, double max_dist, double time_min, double time_max);
     void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
     void Radius_Search(PointType point, const float radius, PointVector &Storage);
-    int Add_Points(PointVector & PointToAdd, bool downsample_on);
+    bool Voxel_Search(PointType point, PointVector &Storage);
+    int Add_Points(PointVector & PointToAdd, bool downsample_on, double time_budget_ms = -1.0);
     void Add_Point_Boxes(vector<BoxPointType> & BoxPoints);
-    void Delete_Points(PointVector & PointToDel);
+    int Delete_Points(PointVector & PointToDel, double time_budget_ms = -1.0);
+    int run_pending_rebuilds(double time_budget_ms);
     int Delete_Point_Boxes(vector<BoxPointType> & BoxPoints);
+    int Delete_Outside_Box(const BoxPointType & BoxPoint);
+    int Delete_Older_Than(double time);
     void flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type);
+    void set_removed_points_recording(bool enable);
+    void set_removed_points_callback(function<void(const PointVector &)> callback);
     void acquire_removed_points(PointVector & removed_points);
     BoxPointType tree_range();
+    bool save(const string & path);
+    bool load(const string & path);
+    bool save_static(const string & path);
+    bool open_journal(const string & path, bool sync = true, size_t batch_bytes = Journal_Batch_Bytes, size_t checkpoint_bytes = Journal_Checkpoint_Bytes);
+    bool flush_journal();
+    bool checkpoint();
+    void close_journal();
+    bool start_trace(const string & path);
+    void stop_trace();
+    bool replay_trace(const string & path, function<void(trace_op_set, double)> latency_callback = nullptr);
+    bool latency_stats(latency_op_set op, LatencyStatsType & stats);
+    void reset_latency_stats();
+    void rebuild_stats(RebuildStatsType & stats, bool reset = false);
+    void set_rebuild_callback(function<void(const RebuildEventType &)> callback);
     PointVector PCL_Storage;     
     KD_TREE_NODE * Root_Node = nullptr;
     int max_queue_size = 0;
 };
 
+// Prebuilt tree queried in place from a file written by KD_TREE::save_static, mapped read-only and shared through the page cache
+template<typename PointType>
+class STATIC_KD_TREE{
+public:
+    using PointVector = vector<PointType>;
+    using Node_Type = Static_Tree_Node_Type<PointType>;
+    using MANUAL_HEAP = typename KD_TREE<PointType>::MANUAL_HEAP;
+    STATIC_KD_TREE() = default;
+    STATIC_KD_TREE(const STATIC_KD_TREE &) = delete;
+    STATIC_KD_TREE & operator = (const STATIC_KD_TREE &) = delete;
+    ~STATIC_KD_TREE();
+    bool open(const string & path);
+    void close();
+    int size();
+    BoxPointType tree_range();
+    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance, double max_dist = INFINITY);
+    void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
+    void Radius_Search(PointType point, const float radius, PointVector &Storage);
+private:
+    void * Mapped_Data = nullptr;
+    size_t Mapped_Size = 0;
+    const Node_Type * Nodes = nullptr;
+    int Node_Num = 0;
+    bool Check_Nodes();
+    void Search(int index, int k_nearest, const PointType & point, MANUAL_HEAP &q, double max_dist);
+    void Search_by_range(int index, const BoxPointType & boxpoint, PointVector &Storage);
+    void Search_by_radius(int index, const PointType & point, float radius, PointVector &Storage);
+    void flatten(int index, PointVector &Storage);
+    float calc_box_dist(int index, const PointType & point);
+};
 
+/*
+    Out-of-core map split into square tiles on the x-y plane, each tile a KD_TREE saved to its own file under a directory.
+    Tiles within the prefetch radius of the pose given to update_pose are paged in by a background thread, farther tiles
+    are saved if modified and paged out, so at most max_resident_tiles trees stay in memory however far the pose travels.
+    Until the first update_pose nothing is prefetched and the most recently written tiles keep the resident slots.
+    Searches merge the results of every resident tile they overlap and skip tiles that are not resident, writes page their
+    tiles in synchronously. Like KD_TREE, the public functions are meant to be called from one thread. Tile trees rebuild
+    inline by default, MultiThreaded tiles each run their own rebuild thread and operation logger.
+*/
+template<typename PointType, typename ThreadPolicy = SingleThreaded>
+class TILED_KD_TREE{
+public:
+    using PointVector = vector<PointType>;
+    using Tree = KD_TREE<PointType, ThreadPolicy>;
+    TILED_KD_TREE(const string & directory, float tile_size, float prefetch_radius, float delete_param = 0.5, float balance_param = 0.6, float box_length = 0.2, RebuildPolicyType rebuild_policy = RebuildPolicyType());
+    TILED_KD_TREE(const TILED_KD_TREE &) = delete;
+    TILED_KD_TREE & operator = (const TILED_KD_TREE &) = delete;
+    ~TILED_KD_TREE();
+    void set_prefetch_radius(float prefetch_radius);
+    void set_max_resident_tiles(int tile_num);
+    void update_pose(PointType pose);
+    void wait_for_paging();
+    bool flush();
+    int tile_num();
+    int resident_tile_num();
+    int size();
+    int validnum();
+    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance, double max_dist = INFINITY);
+    void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
+    void Radius_Search(PointType point, const float radius, PointVector &Storage);
+    int Add_Points(PointVector & PointToAdd, bool downsample_on);
+    int Delete_Points(PointVector & PointToDel);
+    int Delete_Point_Boxes(vector<BoxPointType> & BoxPoints);
+private:
+    enum tile_state_set {TILE_ON_DISK, TILE_LOADING, TILE_RESIDENT, TILE_SAVING};
+    struct Tile_Key_Type{
+        int x, y;
+        bool operator == (const Tile_Key_Type &a)const{
+            return x == a.x && y == a.y;
+        }
+    };
+    struct Tile_Key_Hash{
+        size_t operator () (const Tile_Key_Type &key)const{
+            return (size_t(key.x) * 73856093) ^ (size_t(key.y) * 19349669);
+        }
+    };
+    struct Tile_Type{
+        typename Tree::Ptr tree;
+        tile_state_set state = TILE_ON_DISK;
+        bool dirty = false;
+        bool on_disk = false;
+        long long last_write = 0;
+    };
+    // A tile to load when tree is empty, otherwise a paged out tree to save (if dirty) and release
+    struct Paging_Job_Type{
+        Tile_Key_Type key;
+        typename Tree::Ptr tree;
+        bool dirty;
+    };
+    string Directory;
+    float Tile_Size;
+    float Prefetch_Radius;
+    int Max_Resident_Tiles = Max_Resident_Tile_Num;
+    float Delete_Param, Balance_Param, Box_Length;
+    RebuildPolicyType Rebuild_Policy;
+    PointType Pose;
+    bool Pose_Set = false;
+    long long Write_Counter = 0;
+    unordered_map<Tile_Key_Type, Tile_Type, Tile_Key_Hash> Tiles;
+    deque<Paging_Job_Type> Paging_Jobs;
+    bool Paging_Busy = false;
+    bool termination_flag = false;
+    pthread_t paging_thread;
+    pthread_mutex_t tile_mutex;
+    pthread_cond_t tile_cond;
+    static void * paging_thread_ptr(void *arg);
+    void paging_thread_loop();
+    void Schedule_Paging();
+    typename Tree::Ptr Acquire_Tile(Tile_Key_Type key);
+    typename Tree::Ptr New_Tile_Tree();
+    void Resident_Trees(float x_min, float x_max, float y_min, float y_max, vector<typename Tree::Ptr> & trees);
+    Tile_Key_Type tile_key(float x, float y);
+    string tile_path(Tile_Key_Type key);
+    float tile_dist(Tile_Key_Type key, float x, float y);
+};